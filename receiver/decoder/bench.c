@@ -0,0 +1,399 @@
+/* -*- c -*- */
+/*
+ * Copyright (c) 2013 Peter Scott, OZ2ABA
+ *
+ * Strx correlator is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx correlator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with strx; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "correlator.h"
+
+#define BLOCK_SAMPLES	4096		/* Number of samples fed to the correlator at a time, as in the correlator program. */
+#define FADE_PATHS	16		/* Number of scatterers in the fading model. */
+
+/** @brief  Benchmark for the correlator and the Viterbi decoder.
+ *
+ * Generates trellis encoded packets as the transmitter does, passes them
+ * through an AWGN channel with optional Rayleigh fading and decodes them,
+ * reporting the packet error rate and the decoder throughput for a range of
+ * Eb/N0 values.
+ *
+ * The channel is modelled on the output of the GFSK demodulator after clock
+ * recovery: one soft symbol per bit, +-1 nominal, with the intersymbol
+ * interference of the Gaussian filter and Gaussian noise added.
+ */
+
+static uint64_t		rng_state = 1;		/* State of the random number generator. */
+
+static double		isi [2];		/* Gaussian filter response at the symbol and at the neighbours. */
+
+/* Rayleigh fading by the sum of sinusoids (Clarke's model). */
+static double		fade_rate;		/* Max Doppler frequency relative to the symbol rate. */
+static double		fade_freq [FADE_PATHS];	/* Doppler frequency of each path. */
+static double		fade_phase [FADE_PATHS];	/* Phase of each path. */
+
+
+/** @brief  Random 64 bit number (xorshift64*).
+ */
+static uint64_t rng (void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+
+/** @brief  Uniform random number in 0..1.
+ */
+static double uniform (void)
+{
+	return (rng () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/** @brief  Normal distributed random number.
+ */
+static double gaussian (void)
+{
+	double	u = uniform ();
+
+	return sqrt (-2.0 * log (1.0 - u)) * cos (2 * M_PI * uniform ());
+}
+
+
+/** @brief  Set up the intersymbol interference of the GFSK Gaussian filter.
+ * @param[in]  Bandwidth-time product, 0 for none.
+ *
+ * The demodulator output at the symbol centre is the frequency pulse
+ * response sampled at 0 and +-1 symbol, normalized to 1 for a long run of
+ * equal symbols.
+ */
+static void init_isi (double bt)
+{
+	double	c = 2 * M_PI * bt / sqrt (log (2));
+	double	g [2];
+	int	x;
+
+	if (bt <= 0) {
+		isi [0] = 1;
+		isi [1] = 0;
+		return;
+	}
+
+	for (x = 0; x < 2; x++) {
+		/* Q (c * (t - 1/2)) - Q (c * (t + 1/2)) */
+		g [x] = 0.5 * erfc (c * (x - 0.5) / sqrt (2)) - 0.5 * erfc (c * (x + 0.5) / sqrt (2));
+	}
+	isi [0] = g [0] / (g [0] + 2 * g [1]);
+	isi [1] = g [1] / (g [0] + 2 * g [1]);
+}
+
+
+/** @brief  Set up the fading model.
+ * @param[in]  Max Doppler frequency relative to the symbol rate, 0 for none.
+ */
+static void init_fading (double rate)
+{
+	int	x;
+
+	fade_rate = rate;
+	for (x = 0; x < FADE_PATHS; x++) {
+		fade_freq [x] = rate * cos (2 * M_PI * (x + uniform ()) / FADE_PATHS);
+		fade_phase [x] = 2 * M_PI * uniform ();
+	}
+}
+
+
+/** @brief  Fading amplitude, with a mean power of 1.
+ * @param[in]  Symbol number.
+ */
+static double fading (unsigned long n)
+{
+	double	re = 0;
+	double	im = 0;
+	int	x;
+
+	if (fade_rate <= 0) {
+		return 1;
+	}
+
+	for (x = 0; x < FADE_PATHS; x++) {
+		double	p = 2 * M_PI * fade_freq [x] * n + fade_phase [x];
+
+		re += cos (p);
+		im += sin (p);
+	}
+	return sqrt ((re * re + im * im) / FADE_PATHS);
+}
+
+
+/** @brief  Append the bits of a byte, MSB first.
+ * @param[io]  Bit buffer.
+ * @param[io]  Number of bits in the buffer.
+ * @param[in]  The byte.
+ */
+static void put_byte (int8_t *bits, unsigned int *n, uint8_t byte)
+{
+	int	x;
+
+	for (x = 7; x >= 0; x--) {
+		bits [(*n)++] = (byte >> x) & 1;
+	}
+}
+
+
+/** @brief  Build the bits of a packet as sent by the transmitter.
+ * @param[out]  Bit buffer.
+ * @param[in]  Packet ID.
+ * @param[in]  Payload.
+ * @param[in]  Payload length.
+ * @return  Number of bits.
+ *
+ * Preamble and flag in the clear, followed by the length, the inverted
+ * length, the ID, the payload, the CRC and a padding byte, all trellis
+ * encoded.
+ */
+static unsigned int make_packet (int8_t *bits, uint8_t id, const uint8_t *payload, unsigned int length)
+{
+	uint8_t		body [300];
+	unsigned int	n = 0;
+	unsigned int	len = 0;
+	unsigned int	b = 0;
+	unsigned int	x;
+	uint16_t	crc;
+
+	for (x = 0; x < 5; x++) {
+		put_byte (bits, &n, 0x55);
+	}
+	put_byte (bits, &n, 0x37);
+	put_byte (bits, &n, 0x4F);
+	put_byte (bits, &n, 0xE2);
+	put_byte (bits, &n, 0xDA);
+
+	body [len++] = length;
+	body [len++] = length ^ 0xFF;
+	body [len++] = id;
+	memcpy (&body [len], payload, length);
+	len += length;
+
+	/* The CRC covers an even number of bytes. */
+	body [len] = 0;
+	crc = crc16 (body, len + (len & 1));
+	body [len++] = crc >> 8;
+	body [len++] = crc & 0xFF;
+	body [len++] = 0;
+
+	for (x = 0; x < len; x++) {
+		b = ((b << 8) | body [x]) & 0x3FFF;
+		put_byte (bits, &n, trellis_encoder [(b << 1) + 0]);
+		put_byte (bits, &n, trellis_encoder [(b << 1) + 1]);
+	}
+
+	return n;
+}
+
+
+/** @brief  Monotonic clock in seconds.
+ */
+static double now (void)
+{
+	struct timespec	ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/** @brief  Decode a buffer of samples.
+ * @param[io]  Correlator.
+ * @param[in]  Samples.
+ * @param[in]  Number of samples.
+ * @return  Elapsed time in seconds.
+ */
+static double decode (correlator_t *cor, const float *samples, unsigned long n)
+{
+	double		t0 = now ();
+	unsigned long	x;
+
+	for (x = 0; x < n; x += BLOCK_SAMPLES) {
+		stuff_samples (cor, samples + x, (n - x < BLOCK_SAMPLES) ? n - x : BLOCK_SAMPLES);
+	}
+
+	return now () - t0;
+}
+
+
+static void usage (const char *name)
+{
+	fprintf (stderr, "Usage: %s [-b bt] [-d doppler] [-e first:last:step] [-f] [-l length] [-n packets] [-s seed]\n"
+			 "  -b bt        Bandwidth-time product of the Gaussian filter, 0 for none (default 0.5).\n"
+			 "  -d doppler   Rayleigh fading with this max Doppler frequency relative to\n"
+			 "               the symbol rate, e.g. 0.0001 for 25 Hz at 250 kbit/s (default none).\n"
+			 "  -e range     Eb/N0 values in dB (default 0:10:1).\n"
+			 "  -f           Fixed soft symbol gain instead of adaptive scaling.\n"
+			 "  -l length    Max payload length, 1..255 (default 100).\n"
+			 "  -n packets   Number of packets per Eb/N0 value (default 1000).\n"
+			 "  -s seed      Random seed (default 1).\n", name);
+	exit (1);
+}
+
+
+int main (int argc, char **argv)
+{
+	double		bt = 0.5;
+	double		doppler = 0;
+	double		ebn0_first = 0, ebn0_last = 10, ebn0_step = 1;
+	double		ebn0;
+	unsigned int	max_length = 100;
+	unsigned int	npackets = 1000;
+	unsigned long	max_samples;
+	unsigned long	nsamples;
+	float		*samples;
+	int8_t		*bits;
+	int		fixed_gain = 0;
+	int		opt;
+
+	while ((opt = getopt (argc, argv, "b:d:e:fl:n:s:h")) != -1) {
+		switch (opt) {
+			case 'b':
+				bt = atof (optarg);
+				break;
+			case 'd':
+				doppler = atof (optarg);
+				break;
+			case 'e':
+				if (sscanf (optarg, "%lf:%lf:%lf", &ebn0_first, &ebn0_last, &ebn0_step) < 1) {
+					usage (argv [0]);
+				}
+				break;
+			case 'f':
+				fixed_gain = 1;
+				break;
+			case 'l':
+				max_length = atoi (optarg);
+				break;
+			case 'n':
+				npackets = atoi (optarg);
+				break;
+			case 's':
+				rng_state = strtoull (optarg, NULL, 0) | 1;
+				break;
+			default:
+				usage (argv [0]);
+		}
+	}
+	if (max_length < 1 || max_length > 255 || npackets < 1 || ebn0_step <= 0) {
+		usage (argv [0]);
+	}
+
+	init_trellis_encoder ();
+	init_crc_table ();
+	init_isi (bt);
+	init_fading (doppler);
+	set_packet_log (0);
+	set_soft_scaling (! fixed_gain);
+
+	/* Gap of up to 31 bytes, the packet and the tail of the last one. */
+	max_samples = (unsigned long)npackets * (256 + 72 + (max_length + 6) * 16) + 1024;
+	samples = malloc (max_samples * sizeof (*samples));
+	bits = malloc (max_samples);
+	if (! samples || ! bits) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+
+	/* Hunting only, on noise. */
+	{
+		correlator_t	*cor = new_correlator (0);
+		double		t;
+
+		/* The Viterbi kernel is selected by the first correlator. */
+		printf ("Viterbi kernel: %s  Soft scaling: %s  BT: %.2f  Doppler: %g  Packets: %u  Max length: %u\n",
+			viterbi_kernel, fixed_gain ? "fixed" : "adaptive", bt, doppler, npackets, max_length);
+
+		for (nsamples = 0; nsamples < max_samples; nsamples++) {
+			samples [nsamples] = gaussian ();
+		}
+		t = decode (cor, samples, nsamples);
+		printf ("Hunt: %.1f Msym/s\n\n", nsamples / t * 1e-6);
+		delete_correlator (cor);
+	}
+
+	printf ("Eb/N0   PER       Packets/s  Msym/s  Header us  Packet us  Header errors\n");
+	for (ebn0 = ebn0_first; ebn0 <= ebn0_last + 1e-9; ebn0 += ebn0_step) {
+		/* Rate 1/2 code, unit symbol energy. */
+		double			sigma = sqrt (1.0 / (2 * 0.5 * pow (10, ebn0 / 10)));
+		correlator_t		*cor = new_correlator (0);
+		correlator_stats_t	st;
+		unsigned long		nbits = 0;
+		unsigned long		x;
+		unsigned int		y;
+		double			t;
+
+		/* Bits of all packets, separated by gaps of random bytes, or none at all. */
+		for (y = 0; y < npackets; y++) {
+			uint8_t		payload [255];
+			unsigned int	length = 1 + rng () % max_length;
+			unsigned int	gap = (rng () % 4) ? 8 * (rng () % 32) : 0;
+
+			while (gap--) {
+				bits [nbits++] = rng () & 1;
+			}
+			for (x = 0; x < length; x++) {
+				payload [x] = rng ();
+			}
+			nbits += make_packet (bits + nbits, rng () % 32, payload, length);
+		}
+		while (nbits < max_samples && nbits % 1024) {
+			bits [nbits++] = rng () & 1;
+		}
+
+		/* Through the channel. */
+		for (x = 0; x < nbits; x++) {
+			double	s = bits [x] ? 1 : -1;
+
+			if (isi [1] > 0) {
+				s *= isi [0];
+				s += isi [1] * ((x > 0 && bits [x - 1]) ? 1 : -1);
+				s += isi [1] * ((x + 1 < nbits && bits [x + 1]) ? 1 : -1);
+			}
+			samples [x] = s * fading (x) + sigma * gaussian ();
+		}
+
+		t = decode (cor, samples, nbits);
+		get_correlator_stats (cor, &st);
+
+		printf ("%5.1f   %.2e  %9.0f  %6.2f  %9.2f  %9.2f  %13llu\n",
+			ebn0, 1.0 - (double)st.good / npackets, npackets / t, nbits / t * 1e-6,
+			st.headers + st.header_errors ? st.header_ns * 1e-3 / (st.headers + st.header_errors) : 0,
+			st.good + st.bad ? st.packet_ns * 1e-3 / (st.good + st.bad) : 0,
+			st.header_errors);
+
+		delete_correlator (cor);
+	}
+
+	free (samples);
+	free (bits);
+
+	return 0;
+}
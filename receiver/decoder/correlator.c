@@ -20,33 +20,54 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <unistd.h>
 #include <string.h>
-#include <errno.h>
+#include <math.h>
 #include <time.h>
-#include <signal.h>
-#include <fcntl.h>
 
-#include <sys/types.h>
-#include <sys/socket.h>
 #include <sys/time.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "viterbi.h"
+#include "correlator.h"
+#include "sockets.h"
 
 /** @brief Trellis encoder table.
  */
 uint8_t trellis_encoder [0x8000];
 
+/** @brief CRC-16 lookup table (x^16 + x^12 + x^5 + 1).
+ */
+static uint16_t	crc_table [256];
+
+/** @brief Drop packets failing the CRC check instead of delivering them.
+ *
+ * Off by default: check_crc() has not been verified against frames from the
+ * PIC24 CRC engine yet, and a mismatch would silently discard every packet.
+ */
+static int	crc_drop = 0;
+
+/** @brief Print the decoded packets and header errors on stdout. */
+static int	packet_log = 1;
+
+/** @brief Scale the soft symbols from the tracked signal statistics instead of a fixed gain. */
+static int	adaptive_scaling = 1;
+
+#define AGC_BLOCK	64		/* Samples per gain update. */
+#define AGC_SPAN	1024.0f		/* Time constant of the amplitude and power estimates in samples. */
+#define AGC_REF		8.0f		/* Soft symbol gain per unit of SNR, maps +-A to +-32 at 6 dB. */
+#define FIXED_GAIN	100.0f		/* Gain used without adaptive scaling. */
+
 
 typedef enum {INIT, HUNT, COLLECT_HEAD, COLLECT_ALL} state_t;
 
-typedef struct _correlator_t {
+struct _correlator_t {
 	state_t		state;			/* Engine state. */
-	uint32_t	sr;			/* Shift register for asembling bytes. */
+	uint32_t	sr;			/* Last 32 hard bits while hunting, oldest bit in bit 0. */
 	uint32_t	flag;			/* Flag value. */
+	uint32_t	flag_rev;		/* Flag value bit reversed, to match sr. */
 
 	unsigned int	sampleno;		/* Number of samples collected. */
 	unsigned int	total_samples;		/* Total number of samples to collect for the full packet. */
@@ -60,359 +81,152 @@ typedef struct _correlator_t {
 	struct v	*vp;			/* Viterbi instance. */
 	COMPUTETYPE	*symbols;		/* Pointer to a symbol buffer for the Viterbi decoder. */
 	uint8_t		raw_buf [2048];		/* Buffer for storing the raw packet in packed format (for trellis check). */
-} correlator_t;
 
+	int		channel;		/* Stream (downlink channel) number this instance is decoding. */
 
-fd_set	fixed_read_fds;
-int	fixed_nfds;
+	float		amp;			/* Average symbol amplitude, E|x|. */
+	float		power;			/* Average symbol power, E[x^2]. */
 
-struct client {
-	struct client	*prev;	/* Pointer to the previous one in the chain. */
-	struct client	*next;	/* Pointer to the next one in the chain. */
-	int		fd;	/* Socket file descriptor. */
-};
+	correlator_stats_t	stats;		/* Decoding statistics. */
 
-struct client_set {
-	int			listen_fd;	/* Accept socket. */
-	unsigned long long	packets;	/* Number of packets received on this channel. */
-	unsigned long long	bytes;		/* Number of bytes received on this channel. */
-	struct client		*list;		/* List of connected sockets. */
+	packet_handler_t	handler;	/* Receives the packets instead of the sockets, or NULL. */
+	void		*handler_arg;		/* Argument for the handler. */
 };
 
-struct client_set client_set [270];	/* Array of client sockets. */
-
-uint8_t	last_housekeeping [100];	/* Buffer to hold the last received housekeeping packet. */
-
-/* Macro to insert a entry into a list. */
-#define INSERT_INTO_LIST(list,element) do { \
-	element->next = list; \
-	if (element->next) element->next->prev = element; \
-	list = element; \
-} while (0)
-
-/* Macro to remove a entry from a list. */
-#define REMOVE_FROM_LIST(list,element) do { \
-	if (element->prev == NULL) {	/* First element in the list. */ \
-		list = element->next; \
-		if (element->next) element->next->prev = NULL; \
-	} else {	/* Not the first element. */ \
-		element->prev->next = element->next; \
-		if (element->next) element->next->prev = element->prev; \
-	} \
-} while (0)
-
 
-
-static void init_sockets (void)
+/** @brief  Create the contents of the trellis_encoder table.
+ */
+void init_trellis_encoder (void)
 {
-	int			x;
-	struct sockaddr_in	addr;
-	size_t			addr_size;
-	int			opt_val;
-
-	memset (client_set, 0, sizeof (client_set));
-	FD_ZERO (&fixed_read_fds);
-	fixed_nfds = 0;
-
-	/* Create a listening socket for the first 32 slots. */
-	for (x = 0; x < 32; x++) {
-		client_set [x].listen_fd = socket (AF_INET, SOCK_STREAM, 0);
-		if (client_set [x].listen_fd < 0) {
-			perror ("socket: ");
-			exit (1);
-		}
-
-		opt_val = 1;
-		setsockopt (client_set [x].listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof (opt_val));
-
-		addr.sin_addr.s_addr = INADDR_ANY;
-		addr.sin_port = htons (4000 + x);
-		addr.sin_family = AF_INET;
-		addr_size = sizeof (addr);
-		if (bind (client_set [x].listen_fd, (struct sockaddr *)&addr, addr_size) < 0) {
-			perror ("bind: ");
-			exit (1);
-		}
-
-		if (listen (client_set [x].listen_fd, 5) < 0) {
-			perror ("listen: ");
-			exit (1);
-		}
+	unsigned int	partab [256];	/* Parity lookup table. */
+	unsigned int	w, sr, s, bit, res;
+	uint8_t		*vt = trellis_encoder;
 
-		/* Add the listening handle to the fixed read_fds. */
-		FD_SET (client_set [x].listen_fd, &fixed_read_fds);
-		if (client_set [x].listen_fd >= fixed_nfds) {
-			fixed_nfds = client_set [x].listen_fd + 1;
+	/* Initialize the parity lookup table. */
+	for (w = 0; w < 256; w++) {
+		partab [w] = 0;
+		s = w;
+		for (bit = 0; bit < 8; bit++) {
+			partab [w] ^= s & 0x01;
+			s >>= 1;
 		}
 	}
 
-	/* Create a listening socket for the command port. */
-	client_set [260].listen_fd = socket (AF_INET, SOCK_STREAM, 0);
-	if (client_set [x].listen_fd < 0) {
-		perror ("socket: ");
-		exit (1);
-	}
-
-	opt_val = 1;
-	setsockopt (client_set [260].listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof (opt_val));
+	/* Walk through all possible combinations of a 6 bit history + 8 bits of new data. */
+	for (w = 0; w < 0x4000; w++) {
+		sr = (w >> 8) & 0xFF;		/* Load the shift register with the history part. */
+		s = w & 0xFF;			/* Load the new byte into s. */
 
-	addr.sin_addr.s_addr = INADDR_ANY;
-	addr.sin_port = htons (5000);
-	addr.sin_family = AF_INET;
-	addr_size = sizeof (addr);
-	if (bind (client_set [260].listen_fd, (struct sockaddr *)&addr, addr_size) < 0) {
-		perror ("bind: ");
-		exit (1);
-	}
+		res = 0;			/* Clear the result field. */
+		for (bit = 0; bit < 8; bit++) {
+			sr = (sr << 1) | (s & 0x80 ? 1 : 0);;
+			s <<= 1;
 
-	if (listen (client_set [260].listen_fd, 5) < 0) {
-		perror ("listen: ");
-		exit (1);
-	}
+			res <<= 1;
+			if (partab [sr & 109] >  0) res |= 1;
+			res <<= 1;
+			if (partab [sr &  79] == 0) res |= 1;	/* Second bit is inverted. */
+		}
 
-	/* Add the listening handle to the fixed read_fds. */
-	FD_SET (client_set [260].listen_fd, &fixed_read_fds);
-	if (client_set [260].listen_fd >= fixed_nfds) {
-		fixed_nfds = client_set [260].listen_fd + 1;
+		/* Store the result. */
+		*(vt++) = (res >> 8) & 0xFF;	/* High byte first. */
+		*(vt++) = res & 0xFF;		/* followed by low byte. */
 	}
 }
 
 
-static int dump_telemetry (int fd)
-{
-	char		buf [10000];
-	char		*bc = buf;
-	uint32_t	upt = last_housekeeping [1] + (last_housekeeping [2] << 8) + (last_housekeeping [3] << 16) + (last_housekeeping [4] << 24);
-	float		vbat = ((24.9+4.7)/4.7) * (last_housekeeping [5] + (last_housekeeping [6] << 8)) * (3.3 / 4095.0);
-	int		x;
 
-	/* Forst dump some info from the housekeeping block. */
-	bc += sprintf (bc, "TX: %d  Uptime: %d.%d  Vbat: %5.2f  Flags: %04X",
-			   last_housekeeping [0],
-			   upt / 10, upt % 10,
-			   vbat,
-			   last_housekeeping [7] + (last_housekeeping [8] << 8));
+/** @brief  Create the contents of the crc_table.
+ */
+void init_crc_table (void)
+{
+	unsigned int	x, bit;
+	uint16_t	crc;
 
 	for (x = 0; x < 256; x++) {
-		if (client_set [x].packets > 0) {
-			bc += sprintf (bc, "\t%d:%llu,%llu", x, client_set [x].packets, client_set [x].bytes);
+		crc = x << 8;
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
 		}
+		crc_table [x] = crc;
 	}
-	bc += sprintf (bc, "\n");
-
-	return send (fd, buf, (bc - buf), MSG_NOSIGNAL);
 }
 
 
-static void service_sockets (fd_set *read_fds)
+/** @brief  Select what to do with packets failing the CRC check.
+ * @param[in]  Non-zero to drop them, zero to deliver them anyway (they are still counted and logged as bad).
+ */
+void set_crc_drop (int drop)
 {
-	int	x;
-
-	/* Find the new client (if any). */
-	for (x = 0; x < 32; x++) {
-		if (FD_ISSET (client_set [x].listen_fd, read_fds)) {
-			/* Create a new client. */
-			struct client	*c = calloc (1, sizeof (*c));
-			struct sockaddr	addr;
-			socklen_t	addr_size = sizeof (addr);
-
-			c->fd = accept (client_set [x].listen_fd, &addr, &addr_size);
-
-			/* Make socket non-blocking. */
-			fcntl (c->fd, F_SETFL, O_NONBLOCK);
-
-			/* Add the listening handle to the fixed read_fds. */
-			FD_SET (c->fd, &fixed_read_fds);
-			if (c->fd >= fixed_nfds) {
-				fixed_nfds = c->fd + 1;
-			}
-
-			/* Insert at the head of the list. */
-			INSERT_INTO_LIST (client_set [x].list, c);
-		}
-	}
-
-	/*  Check if any client have transmitted data - if so just flush it. */
-	for (x = 0; x < 32; x++) {
-		struct client	*cnext = client_set [x].list;
-		struct client	*c = cnext;
-
-		while ((c = cnext)) {
-			cnext = c->next;
-
-			if (FD_ISSET (c->fd, read_fds)) {
-				char 	buf [4096];
-				int	y;
-
-				y = recv (c->fd, &buf, sizeof (buf), 0);
-				if (y < 0 && errno != EINTR && errno != EAGAIN) {
-					/* Read error. Ditch this user. */
-					close (c->fd);
-					FD_CLR (c->fd, &fixed_read_fds);
-					REMOVE_FROM_LIST (client_set [x].list, c);
-					free (c);
-				} else if (y == 0) {
-					/* EOF. */
-					close (c->fd);
-					FD_CLR (c->fd, &fixed_read_fds);
-					REMOVE_FROM_LIST (client_set [x].list, c);
-					free (c);
-				}
-			}
-		}
-	}
-
-	/* Check if any client have transmitted data on the control channel. */
-	if (FD_ISSET (client_set [260].listen_fd, read_fds)) {
-		/* Create a new client. */
-		struct client	*c = calloc (1, sizeof (*c));
-		struct sockaddr	addr;
-		socklen_t	addr_size = sizeof (addr);
-
-		c->fd = accept (client_set [260].listen_fd, &addr, &addr_size);
-		if (c->fd >= 0) {
-			/* Make socket non-blocking. */
-			fcntl (c->fd, F_SETFL, O_NONBLOCK);
-
-			/* Add the real handle to the fixed read_fds. */
-			FD_SET (c->fd, &fixed_read_fds);
-			if (c->fd >= fixed_nfds) {
-				fixed_nfds = c->fd + 1;
-			}
-
-			/* Insert at the head of the list. */
-			INSERT_INTO_LIST (client_set [260].list, c);
-		}
-	}
-
-	/* Check if any data is received on the monitor port. */
-	{
-		struct client	*cnext = client_set [260].list;
-		struct client	*c;
-
-		while ((c = cnext)) {
-			cnext = c->next;
-
-			if (FD_ISSET (c->fd, read_fds)) {
-				char 	buf [4096];
-				int	y;
-
-				y = recv (c->fd, &buf, sizeof (buf), 0);
-				if (y < 0) {
-					if (errno != EINTR && errno != EAGAIN) {
-						/* Monitor client disappeared. Close down. */
-						close (c->fd);
-						FD_CLR (c->fd, &fixed_read_fds);
-						REMOVE_FROM_LIST (client_set [260].list, c);
-						free (c);
-					}
-				} else if (y == 0) {
-					/* EOF. */
-					close (c->fd);
-					FD_CLR (c->fd, &fixed_read_fds);
-					REMOVE_FROM_LIST (client_set [260].list, c);
-					free (c);
-				} else if (y > 0) {
-					/* Something received. Dump telemetry status. */
-					if (dump_telemetry (c->fd) < 0) {
-						/* Monitor client disappeared. Close down. */
-						close (c->fd);
-						FD_CLR (c->fd, &fixed_read_fds);
-						REMOVE_FROM_LIST (client_set [260].list, c);
-						free (c);
-					}
-				}
-			}
-		}
-	}
+	crc_drop = drop;
 }
 
 
-void write_socket (int sockno, int length, uint8_t *data)
+/** @brief  Select whether the decoded packets are printed.
+ * @param[in]  Non-zero to print every packet and header error on stdout.
+ */
+void set_packet_log (int enable)
 {
-	/* Send the packet to all subscribers of the sockno value. */
-	struct client	*cnext = client_set [sockno].list;
-	struct client	*c = cnext;
-	int		x;
-
-	client_set [sockno].packets++;
-	client_set [sockno].bytes += length;
+	packet_log = enable;
+}
 
-	while ((c = cnext)) {
-		cnext = c->next;
 
-		x = send (c->fd, data, length, MSG_NOSIGNAL);
-		if (x < 0) {
-			/* The socket died. Clean up. */
-			close (c->fd);
-			FD_CLR (c->fd, &fixed_read_fds);
+/** @brief  Select how the demodulated samples are scaled to soft symbols.
+ * @param[in]  Non-zero to scale them from the tracked amplitude and noise, zero for the fixed gain.
+ */
+void set_soft_scaling (int adaptive)
+{
+	adaptive_scaling = adaptive;
+}
 
-			/* Remove it from the list. */
-			if (c->prev == NULL) {
-				/* First element in the list. */
-				client_set [sockno].list = c->next;
-				if (c->next) {
-					c->next->prev = NULL;
-				}
 
-				free (c);
-			} else {
-				/* Not the first element. */
-				c->prev->next = c->next;
-				if (c->next) {
-					c->next->prev = c->prev;
-				}
+/** @brief  Calculate the CRC-16 of a block of bytes, MSB first with a zero initial value.
+ */
+uint16_t crc16 (const uint8_t *data, unsigned int length)
+{
+	uint16_t	crc = 0;
 
-				free (c);
-			}
-		}
+	while (length--) {
+		crc = (crc << 8) ^ crc_table [((crc >> 8) ^ *(data++)) & 0xFF];
 	}
+
+	return crc;
 }
 
 
-/** @brief  Create the contents of the trellis_encoder table.
+/** @brief  Check the CRC of the decoded packet.
+ * @param[in]  Pointer to the correlator instance.
+ * @return  Non-zero if the CRC is correct.
+ *
+ * Mirrors prepare_packet() in the transmitter firmware: the CRC covers the
+ * length, the inverted length, the ID and the payload, padded with a zero
+ * byte to an even number of bytes, and is sent high byte first after the
+ * payload.
  */
-static void init_trellis_encoder (void)
+static int check_crc (correlator_t *cor)
 {
-	unsigned int	partab [256];	/* Parity lookup table. */
-	unsigned int	w, sr, s, bit, res;
-	uint8_t		*vt = trellis_encoder;
+	unsigned int	len = cor->packet_len - 2;
+	uint16_t	crc = crc16 (cor->packet_buf, len);
 
-	/* Initialize the parity lookup table. */
-	for (w = 0; w < 256; w++) {
-		partab [w] = 0;
-		s = w;
-		for (bit = 0; bit < 8; bit++) {
-			partab [w] ^= s & 0x01;
-			s >>= 1;
-		}
+	if (len & 0x01) {
+		crc = (crc << 8) ^ crc_table [(crc >> 8) & 0xFF];
 	}
 
-	/* Walk through all possible combinations of a 6 bit history + 8 bits of new data. */
-	for (w = 0; w < 0x4000; w++) {
-		sr = (w >> 8) & 0xFF;		/* Load the shift register with the history part. */
-		s = w & 0xFF;			/* Load the new byte into s. */
+	return crc == ((cor->packet_buf [len] << 8) | cor->packet_buf [len + 1]);
+}
 
-		res = 0;			/* Clear the result field. */
-		for (bit = 0; bit < 8; bit++) {
-			sr = (sr << 1) | (s & 0x80 ? 1 : 0);;
-			s <<= 1;
 
-			res <<= 1;
-			if (partab [sr & 109] >  0) res |= 1;
-			res <<= 1;
-			if (partab [sr &  79] == 0) res |= 1;	/* Second bit is inverted. */
-		}
+/** @brief  Monotonic clock in nanoseconds, for the decoding statistics. */
+static inline uint64_t clock_ns (void)
+{
+	struct timespec	ts;
 
-		/* Store the result. */
-		*(vt++) = (res >> 8) & 0xFF;	/* High byte first. */
-		*(vt++) = res & 0xFF;		/* followed by low byte. */
-	}
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 
-
-inline int popcount_8 (unsigned int v)
+static inline int popcount_8 (unsigned int v)
 {
 	v = ((v >> 1) & 0x55) + (v & 0x55);
 	v = ((v >> 2) & 0x33) + (v & 0x33);
@@ -420,29 +234,131 @@ inline int popcount_8 (unsigned int v)
 	return v;
 }
 
-inline int popcount_16 (unsigned int v)
+static inline uint32_t reverse_32 (uint32_t v)
 {
-	return popcount_8 (v >> 8) + popcount_8 (v);
+	v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+	v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+	v = ((v >> 4) & 0x0F0F0F0F) | ((v & 0x0F0F0F0F) << 4);
+	v = ((v >> 8) & 0x00FF00FF) | ((v & 0x00FF00FF) << 8);
+	return (v >> 16) | (v << 16);
 }
 
-inline int popcount_32 (unsigned int v)
+
+/** @brief  Check a flag candidate against the error tolerance rules.
+ * @param[in]  Bit number since the end of the last packet.
+ * @param[in]  Number of bits differing from the flag.
+ * @return  Non-zero if the flag is accepted.
+ */
+static inline int flag_match (unsigned int pbit, unsigned int flag_err)
 {
-	return popcount_16 (v >> 16) + popcount_16 (v);
+	return (pbit == 72      && flag_err < 5) ||		/* On time. Accept 4 errors. */
+	       ((pbit % 8) == 0 && flag_err < 3) ||		/* On a byte boundary. Accept 2 errors. */
+	       (pbit != 76      && flag_err < 1);		/* Otherwise need an exact match. */
 }
 
-inline int popcount_64 (uint64_t v)
+
+/** @brief  Search a block of hard bits for the flag.
+ * @param[in]  The last 32 bits before the block, oldest bit in bit 0.
+ * @param[in]  The block of bits, first bit in bit 0.
+ * @param[in]  Number of bits in the block, 1..32.
+ * @param[in]  Bit reversed flag.
+ * @param[in]  Bit number of the bit before the block.
+ * @return  The number of bits up to and including the end of the flag, or 0 if not found.
+ *
+ * The history and the block form a 64 bit window, where the 32 bits ending
+ * at bit i of the block are simply the window shifted down by i + 1. Each
+ * offset then costs a shift, an xor and a popcount. Built with and without
+ * hardware popcnt, selected at load time.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+__attribute__ ((target_clones ("popcnt", "default")))
+#endif
+static unsigned int hunt_flag (uint32_t sr, uint32_t bits, unsigned int n, uint32_t flag_rev, unsigned int pbit)
 {
-	return popcount_32 (v >> 32) + popcount_32 (v);
+	uint64_t	w = ((uint64_t)bits << 32) | sr;
+	unsigned int	x;
+
+	for (x = 0; x < n; x++) {
+		unsigned int	err = __builtin_popcount ((uint32_t)(w >> (x + 1)) ^ flag_rev);
+
+		/* No rule accepts more than 4 errors. */
+		if (err < 5 && flag_match (pbit + x + 1, err)) {
+			return x + 1;
+		}
+	}
+
+	return 0;
 }
 
 
+/** @brief  Hunt for the flag in a block of soft symbols.
+ * @param[io]  Pointer to the correlator instance.
+ * @param[in]  Pointer to the soft symbols.
+ * @param[in]  Number of symbols, 1..32. Up to 32 symbols are read.
+ * @return  The number of symbols consumed.
+ *
+ * Stops right after the flag, leaving the correlator in COLLECT_HEAD.
+ */
+static unsigned int hunt_block (correlator_t *cor, const uint8_t *q, unsigned int n)
+{
+	uint32_t	bits;
+	unsigned int	found;
+
+	if (cor->state == INIT) {
+		/* Reset state machines. */
+		cor->pbit = 0;
+		cor->sr = 0;
+		cor->state = HUNT;
+	}
+
+	/* The hard decision is the top bit of the soft symbol. */
+#ifdef __SSE2__
+	bits = _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)q)) |
+	       (_mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)(q + 16))) << 16);
+#else
+	{
+		unsigned int	x;
+
+		bits = 0;
+		for (x = 0; x < n; x++) {
+			bits |= (uint32_t)(q [x] >> 7) << x;
+		}
+	}
+#endif
+	if (n < 32) {
+		bits &= (1u << n) - 1;
+	}
+
+	found = hunt_flag (cor->sr, bits, n, cor->flag_rev, cor->pbit);
+	if (found) {
+		cor->flag_err = __builtin_popcount ((uint32_t)((((uint64_t)bits << 32) | cor->sr) >> found) ^ cor->flag_rev);
+		cor->pbit += found;
+		cor->state = COLLECT_HEAD;
+		cor->sampleno = 0;
+		cor->total_samples = 0;
+		cor->sr = 0;
+		cor->raw_buf [0] = 0;
+		return found;
+	}
+
+	cor->sr = (((uint64_t)bits << 32) | cor->sr) >> n;
+	cor->pbit += n;
+	return n;
+}
+
 
-static correlator_t *new_correlator (void)
+correlator_t *new_correlator (int channel)
 {
 	correlator_t	*new = calloc (sizeof (*new), 1);
 
 	new->state = HUNT;
+	new->channel = channel;
 	new->flag = 0x374FE2DA;
+	new->flag_rev = reverse_32 (new->flag);
+
+	/* Start out assuming a unit amplitude at 6 dB SNR. */
+	new->amp = 1.0;
+	new->power = 1.25;
 
 	/* Allocate memory for the viterbi symbol buffer. */
 	if (posix_memalign((void**)&new->symbols, 16, RATE*(FRAMEBITS+(K-1))*sizeof(COMPUTETYPE))){
@@ -461,73 +377,114 @@ static correlator_t *new_correlator (void)
 }
 
 
+void delete_correlator (correlator_t *cor)
+{
+	delete_viterbi (cor->vp);
+	free (cor->symbols);
+	free (cor);
+}
+
+
+/** @brief  Get the decoding statistics of a correlator.
+ * @param[in]  Pointer to the correlator instance.
+ * @param[out]  The statistics.
+ */
+void get_correlator_stats (const correlator_t *cor, correlator_stats_t *stats)
+{
+	*stats = cor->stats;
+}
+
+
+/** @brief  Pass the packets of a correlator to a handler instead of the sockets.
+ * @param[io]  Pointer to the correlator instance.
+ * @param[in]  The handler, NULL to deliver to the sockets again.
+ * @param[in]  Argument passed to the handler.
+ *
+ * The handler is called from stuff_samples(), with the same packets that
+ * would be delivered to the sockets. The sockets need not be initialized
+ * for a correlator with a handler.
+ */
+void set_packet_handler (correlator_t *cor, packet_handler_t handler, void *arg)
+{
+	cor->handler = handler;
+	cor->handler_arg = arg;
+}
+
+
 /** @brief  Deliver the collected packet.
  * @param[io]  Pointer to the correlator instance.
  */
-void deliver_packet (correlator_t *cor)
+static void deliver_packet (correlator_t *cor)
 {
 	int		x;
 	char		t [100];
 	struct timeval	tv;
+	int		crc_ok = check_crc (cor);
+
+	if (crc_ok) {
+		cor->stats.good++;
+	} else {
+		cor->stats.bad++;
+	}
+
+	if (cor->handler) {
+		packet_info_t	info;
+
+		if (crc_ok || ! crc_drop) {
+			info.channel = cor->channel;
+			info.data = cor->packet_buf;
+			info.len = cor->packet_len;
+			info.crc_ok = crc_ok;
+			info.flag_err = cor->flag_err;
+			info.trellis_err = cor->trellis_err;
+			cor->handler (cor->handler_arg, &info);
+		}
+		return;
+	}
 
-	/* Print a timestamp. */
-	gettimeofday (&tv, NULL);
-	strftime (t, sizeof (t), "%F %T", gmtime (&tv.tv_sec));
-	printf ("%s.%03ld ", t, tv.tv_usec / 1000);
+	lock_sockets ();
 
-	printf ("pbit: %5d  flag err: %1d  trellis err: %2u  ", cor->pbit, cor->flag_err, cor->trellis_err);
-	printf ("Len: %3d  Len2: %3d  CRC: %04X  ID: %3u", cor->packet_buf [0], cor->packet_buf [1] ^ 0xFF, (cor->packet_buf [cor->packet_len - 2]<<8) | cor->packet_buf [cor->packet_len - 1], cor->packet_buf [2]);
-	printf ("  Packet:");
-	for (x = 0; x  < cor->packet_len; x++) {
-		printf (" %02X", cor->packet_buf [x]);
+	if (packet_log) {
+		/* Print a timestamp. */
+		gettimeofday (&tv, NULL);
+		strftime (t, sizeof (t), "%F %T", gmtime (&tv.tv_sec));
+		printf ("%s.%03ld ", t, tv.tv_usec / 1000);
+
+		printf ("CH: %d  pbit: %5d  flag err: %1d  trellis err: %2u  ", cor->channel, cor->pbit, cor->flag_err, cor->trellis_err);
+		printf ("Len: %3d  Len2: %3d  CRC: %04X %s  ID: %3u", cor->packet_buf [0], cor->packet_buf [1] ^ 0xFF, (cor->packet_buf [cor->packet_len - 2]<<8) | cor->packet_buf [cor->packet_len - 1], crc_ok ? "OK " : "BAD", cor->packet_buf [2]);
+		printf ("  Packet:");
+		for (x = 0; x  < cor->packet_len; x++) {
+			printf (" %02X", cor->packet_buf [x]);
+		}
+		printf ("\n");
 	}
-	printf ("\n");
 
-	/* Deliver data to network socket. */
-	write_socket (cor->packet_buf [2], cor->packet_len - 5, &cor->packet_buf [3]);
+	/* A bad packet may have a corrupted ID as well, so the bad count of an ID is only indicative. */
+	count_packet (cor->packet_buf [2], crc_ok, cor->trellis_err > 0);
+
+	if (crc_ok || ! crc_drop) {
+		/* Deliver data to network socket. */
+		write_socket (cor->packet_buf [2], cor->packet_len - 5, &cor->packet_buf [3]);
 
-	if (cor->packet_buf [2] <= 3) {
-		/* This is a housekeeping packet. Keep the last one around. */
-		memcpy (last_housekeeping, &cor->packet_buf [2], cor->packet_len - 4);
+		if (cor->packet_buf [2] <= 3) {
+			/* This is a housekeeping packet. Keep the last one around. */
+			set_housekeeping (&cor->packet_buf [2], cor->packet_len - 4);
+		}
 	}
+
+	unlock_sockets ();
 }
 
 
-/** @brief  Add a sample to the state machine.
+/** @brief  Add a sample to the state machine while collecting a packet.
  * @param[io]  Pointer to the correlator instance.
  * @param[in]  Sample value. Value set: 0..127, 128..255.
  */
-void stuff_sample (correlator_t *cor, unsigned int sample)
+static void stuff_sample (correlator_t *cor, unsigned int sample)
 {
 	switch (cor->state) {
-		case INIT:	/* Reset state machines. */
-			cor->pbit = 0;
-			cor->sr = 0;
-
-			/* Change state and fall down into HUNT mode. */
-			cor->state = HUNT;
-
-		case HUNT:	/* Look for a flag. */
-			/* Shift the sample into the shift register. */
-			cor->sr <<= 1;
-			if (sample >= 128) {
-				cor->sr |= 1;
-			}
-			cor->pbit++;
-//printf ("HUNT: pbit: %6u  val: %3u  sr: %08X\n", cor->pbit, sample, cor->sr);
-
-			/* Check for flag match. Allow one bit error in the flag. */
-			cor->flag_err = popcount_32 (cor->sr ^ cor->flag);
-			if ((cor->pbit == 72      && cor->flag_err < 5) ||		/* On time. Accept 4 errors. */
-			    ((cor->pbit % 8) == 0 && cor->flag_err < 3) ||		/* On a byte boundary. Accept 2 errors. */
-			    (cor->pbit != 76      && cor->flag_err < 1)) {		/* Otherwise need an exact match. */
-				// printf ("\nFlag fundet efter %d  ", cor->pbit);
-				cor->state = COLLECT_HEAD;
-				cor->sampleno = 0;
-				cor->total_samples = 0;
-				cor->sr = 0;
-				cor->raw_buf [0] = 0;
-			}
+		case INIT:
+		case HUNT:	/* Handled by hunt_block(). */
 			break;
 
 		case COLLECT_HEAD:	/* Collect samples for interpreting the header. */
@@ -546,11 +503,14 @@ void stuff_sample (correlator_t *cor, unsigned int sample)
 //printf ("HEAD: sampleno: %6u  val: %3u\n", cor->sampleno, sample);
 
 			if (cor->sampleno == (5*8 + (K-1)) * RATE) {
+				uint64_t	t0 = clock_ns ();
+
 				/* Decode the samples to extract the length field. */
 				memset (&cor->packet_buf, 0xFF, sizeof (cor->packet_buf));
 				init_viterbi (cor->vp, 0);
-				update_viterbi_blk_GENERIC (cor->vp, cor->symbols, 5*8 + (K-1));
+				update_viterbi_blk (cor->vp, cor->symbols, 5*8 + (K-1));
 				chainback_viterbi (cor->vp, cor->packet_buf, 5*8, 0);
+				cor->stats.header_ns += clock_ns () - t0;
 
 				/* The length and the inverted length are stored as the first two bytes. */
 				if (cor->packet_buf [0] == (cor->packet_buf [1] ^ 0xFF)) {
@@ -560,10 +520,14 @@ void stuff_sample (correlator_t *cor, unsigned int sample)
 
 					/* Add one padding byte for flushing the trellis encoder. */
 					cor->total_samples = RATE * (cor->packet_len + 1) * 8;
+					cor->stats.headers++;
 //printf ("Header OK: plen: %3d  samples: %5d\n", cor->packet_len, cor->total_samples);
 				} else {
 					/* Invalid length bytes. GO back to HUNT. */
+					if (packet_log) {
 printf ("Header error: len1: %3d  len2: %3d\n", cor->packet_buf [0], cor->packet_buf [1] ^ 0xFF);
+					}
+					cor->stats.header_errors++;
 					cor->state = INIT;
 				}
 			}
@@ -585,10 +549,12 @@ printf ("Header error: len1: %3d  len2: %3d\n", cor->packet_buf [0], cor->packet
 //printf ("ALL:  sampleno: %6u  val: %3u\n", cor->sampleno, sample);
 
 			if (cor->sampleno == cor->total_samples) {
+				uint64_t	t0 = clock_ns ();
+
 				/* Decode the samples to extract the whole packet. */
 				cor->packet_buf [cor->packet_len] = 0;	/* Zero the tralier byte. */
 				init_viterbi (cor->vp, 0);
-				update_viterbi_blk_GENERIC (cor->vp, cor->symbols, cor->packet_len * 8 + (K-1));
+				update_viterbi_blk (cor->vp, cor->symbols, cor->packet_len * 8 + (K-1));
 				chainback_viterbi (cor->vp, cor->packet_buf, 8*cor->packet_len, 0);
 
 				/* Re-encode the packet to count the number of errors corrected by the Trellis code. */
@@ -613,6 +579,8 @@ printf ("Header error: len1: %3d  len2: %3d\n", cor->packet_buf [0], cor->packet
 					}
 				}
 
+				cor->stats.packet_ns += clock_ns () - t0;
+
 				deliver_packet (cor);
 				cor->state = INIT;
 			}
@@ -621,69 +589,127 @@ printf ("Header error: len1: %3d  len2: %3d\n", cor->packet_buf [0], cor->packet
 }
 
 
-int main (int argc, char **argv)
+/** @brief  Sum the amplitude and power of a block of samples.
+ * @param[in]  Pointer to the samples.
+ * @param[in]  Number of samples.
+ * @param[out]  Sum of |x|.
+ * @param[out]  Sum of x^2.
+ */
+static void sum_block (const float *v, unsigned int len, float *sum_amp, float *sum_power)
 {
-	uint8_t		input_buffer [65536];
-	unsigned int	input_offset = 0;
-	int		x;
-	int		active_fds;
-	correlator_t	*cor = new_correlator ();
-	fd_set		read_fds;
-	int		nfds;
+	float		a = 0;
+	float		p = 0;
+	unsigned int	x = 0;
 
-	/* Ignore SIGPIPE interrupts. */
-	signal (SIGPIPE, SIG_IGN);
+#ifdef __SSE2__
+	__m128		abs_mask = _mm_castsi128_ps (_mm_set1_epi32 (0x7FFFFFFF));
+	__m128		va = _mm_setzero_ps ();
+	__m128		vp = _mm_setzero_ps ();
+	float		t [4];
 
-	init_trellis_encoder ();
-	init_sockets ();
+	for (; x + 4 <= len; x += 4) {
+		__m128	s = _mm_loadu_ps (v + x);
 
-	/* Read samples from stdin. */
-	while (1) {
-		/* Prepare the select. */
-		read_fds = fixed_read_fds;
-		nfds = fixed_nfds;
-		FD_SET (0, &read_fds);
+		va = _mm_add_ps (va, _mm_and_ps (s, abs_mask));
+		vp = _mm_add_ps (vp, _mm_mul_ps (s, s));
+	}
+	_mm_storeu_ps (t, va);
+	a = t [0] + t [1] + t [2] + t [3];
+	_mm_storeu_ps (t, vp);
+	p = t [0] + t [1] + t [2] + t [3];
+#endif
+
+	for (; x < len; x++) {
+		a += fabsf (v [x]);
+		p += v [x] * v [x];
+	}
 
-		active_fds = select (nfds, &read_fds, NULL, NULL, NULL);
+	*sum_amp = a;
+	*sum_power = p;
+}
 
-		if (active_fds == -1) {
-			if (errno == EINTR || errno == EAGAIN) {
-				continue;	/* Interrupted system call. Just retry. */
-			}
-			perror ("select: ");
-			exit (2);
-		}
 
-		/* Service the main input socket. */
-		if (FD_ISSET (0, &read_fds)) {
-			float	*v;
+/** @brief  Convert a block of samples to soft symbols.
+ * @param[in]  Pointer to the samples.
+ * @param[in]  Number of samples.
+ * @param[in]  Gain.
+ * @param[out]  Soft symbols, 128 + x * gain clipped to 0..255.
+ */
+static void quantize_block (const float *v, unsigned int len, float gain, uint8_t *out)
+{
+	unsigned int	x = 0;
+
+#ifdef __SSE2__
+	__m128		g = _mm_set1_ps (gain);
+	__m128i		offset = _mm_set1_epi32 (128);
+
+	for (; x + 8 <= len; x += 8) {
+		__m128i	lo = _mm_add_epi32 (_mm_cvtps_epi32 (_mm_mul_ps (_mm_loadu_ps (v + x), g)), offset);
+		__m128i	hi = _mm_add_epi32 (_mm_cvtps_epi32 (_mm_mul_ps (_mm_loadu_ps (v + x + 4), g)), offset);
+
+		/* Saturating packs clip to 0..255. */
+		_mm_storel_epi64 ((__m128i *)(out + x), _mm_packus_epi16 (_mm_packs_epi32 (lo, hi), _mm_setzero_si128 ()));
+	}
+#endif
+
+	for (; x < len; x++) {
+		float	q = rintf (v [x] * gain) + 128;
+
+		out [x] = (q < 0) ? 0 : (q > 255) ? 255 : q;
+	}
+}
 
-			x = read (0, &input_buffer [input_offset], sizeof (input_buffer) - input_offset);
-			if (x <= 0) break;
 
-			v = (float *)&input_buffer [0];
-			x += input_offset;
-			while (x >= sizeof (*v)) {
-				stuff_sample (cor, *v * 100.0 + 128);	/* Convert from -1..0..+1 format to 0..127,128..255 format. */
-				x -= sizeof (*v);
-				v++;
+/** @brief  Add a block of demodulated samples to the state machine.
+ * @param[io]  Pointer to the correlator instance.
+ * @param[in]  Pointer to the samples, nominally -1..+1.
+ * @param[in]  Number of samples.
+ *
+ * The samples are scaled to soft symbols proportional to the log likelihood
+ * ratio, 2 * A * x / sigma^2, using the symbol amplitude and noise variance
+ * tracked over the last ~1000 samples. Symbols received during a fade thus
+ * get a low weight in the Viterbi decoder instead of being amplified along
+ * with the noise, while strong signals are not clipped.
+ */
+void stuff_samples (correlator_t *cor, const float *v, unsigned int len)
+{
+	uint8_t		q [AGC_BLOCK + 32];	/* Room for hunt_block() reading past the end. */
+	float		sum_amp, sum_power;
+	float		gain = FIXED_GAIN;
+	float		var;
+	unsigned int	n;
+	unsigned int	x;
+
+	while (len > 0) {
+		n = (len < AGC_BLOCK) ? len : AGC_BLOCK;
+
+		if (adaptive_scaling) {
+			sum_block (v, n, &sum_amp, &sum_power);
+			cor->amp += (sum_amp - n * cor->amp) / AGC_SPAN;
+			cor->power += (sum_power - n * cor->power) / AGC_SPAN;
+
+			/* Limit the SNR to 30 dB and guard against silence. */
+			var = cor->power - cor->amp * cor->amp;
+			if (var < cor->amp * cor->amp * 1e-3f) {
+				var = cor->amp * cor->amp * 1e-3f;
 			}
-			input_offset = 0;
-			if (x > 0) {
-				/* Partial read of the last value. Move it to the head of the buffer and prepare for the next batch. */
-				uint8_t	*p = (void *)v;
-				while (x-- > 0) {
-					input_buffer [input_offset++] = *(p++);
-				}
+			if (var < 1e-12f) {
+				var = 1e-12f;
 			}
-			active_fds--;
+			gain = AGC_REF * cor->amp / var;
 		}
 
-		/* Handle all the other sockets if any may be available. */
-		if (active_fds > 0) {
-			service_sockets (&read_fds);
+		quantize_block (v, n, gain, q);
+		x = 0;
+		while (x < n) {
+			if (cor->state == INIT || cor->state == HUNT) {
+				x += hunt_block (cor, q + x, (n - x < 32) ? n - x : 32);
+			} else {
+				stuff_sample (cor, q [x++]);
+			}
 		}
-	}
 
-	return 0;
+		v += n;
+		len -= n;
+	}
 }
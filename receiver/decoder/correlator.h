@@ -0,0 +1,83 @@
+/* -*- c -*- */
+/*
+ * Copyright (c) 2013 Peter Scott, OZ2ABA
+ *
+ * Strx correlator is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx correlator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with strx; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef CORRELATOR_H
+#define CORRELATOR_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief  Correlator and packet decoder for one demodulated stream.
+ *
+ * The correlator hunts for the sync flag in the stream of soft symbols,
+ * runs the header and the packet through the Viterbi decoder and delivers
+ * the decoded packets to the distribution sockets.
+ */
+typedef struct _correlator_t correlator_t;
+
+/** @brief  Decoding statistics of a correlator. */
+typedef struct {
+	unsigned long long	headers;	/* Flags followed by a valid length field. */
+	unsigned long long	header_errors;	/* Flags followed by an invalid length field. */
+	unsigned long long	good;		/* Packets passing the CRC check. */
+	unsigned long long	bad;		/* Packets failing the CRC check. */
+	unsigned long long	header_ns;	/* Time spent decoding the headers. */
+	unsigned long long	packet_ns;	/* Time spent decoding the packets. */
+} correlator_stats_t;
+
+/** @brief  A decoded packet, as passed to a packet handler. */
+typedef struct {
+	int		channel;	/* Stream (downlink channel) number. */
+	const uint8_t	*data;		/* The packet: length, inverted length, ID, payload and CRC. */
+	unsigned int	len;		/* Number of bytes in data. */
+	int		crc_ok;		/* Non-zero if the CRC is correct. */
+	unsigned int	flag_err;	/* Number of error bits in the flag. */
+	unsigned int	trellis_err;	/* Number of error bits corrected by the Trellis code. */
+} packet_info_t;
+
+/** @brief  Packet handler, called from stuff_samples() for every delivered packet. */
+typedef void (*packet_handler_t) (void *arg, const packet_info_t *packet);
+
+/** @brief Trellis encoder table. */
+extern uint8_t trellis_encoder [0x8000];
+
+/** @brief Name of the Viterbi kernel selected for this CPU. */
+extern const char *viterbi_kernel;
+
+void init_trellis_encoder (void);
+void init_crc_table (void);
+void set_crc_drop (int drop);
+void set_soft_scaling (int adaptive);
+void set_packet_log (int enable);
+uint16_t crc16 (const uint8_t *data, unsigned int length);
+
+correlator_t *new_correlator (int channel);
+void delete_correlator (correlator_t *cor);
+void get_correlator_stats (const correlator_t *cor, correlator_stats_t *stats);
+void stuff_samples (correlator_t *cor, const float *samples, unsigned int len);
+void set_packet_handler (correlator_t *cor, packet_handler_t handler, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CORRELATOR_H */
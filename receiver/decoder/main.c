@@ -0,0 +1,389 @@
+/* -*- c -*- */
+/*
+ * Copyright (c) 2013 Peter Scott, OZ2ABA
+ *
+ * Strx correlator is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx correlator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with strx; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "correlator.h"
+#include "sockets.h"
+
+#define MAX_STREAMS	16		/* Max number of demodulated streams. */
+#define BLOCK_SAMPLES	4096		/* Number of samples in a queue block. */
+#define QUEUE_BLOCKS	16		/* Number of blocks in a stream queue. */
+
+/* A demodulated stream, decoded by its own correlator on its own worker thread. */
+typedef struct _stream_t {
+	correlator_t	*cor;			/* Correlator state machine for this stream. */
+	pthread_t	thread;			/* Worker thread. */
+
+	pthread_mutex_t	lock;			/* Protects the queue counters below. */
+	pthread_cond_t	not_empty;		/* Signalled when a block is committed. */
+	pthread_cond_t	not_full;		/* Signalled when a block is released. */
+	float		queue [QUEUE_BLOCKS][BLOCK_SAMPLES];	/* Sample blocks. */
+	unsigned int	queue_len [QUEUE_BLOCKS];		/* Number of samples in each block. */
+	unsigned int	head;			/* Oldest committed block. */
+	unsigned int	tail;			/* Block being filled by the input thread. */
+	unsigned int	count;			/* Number of committed blocks. */
+	int		eof;			/* No more blocks will be committed. */
+} stream_t;
+
+/* An input file descriptor carrying one or more interleaved streams. */
+typedef struct _input_t {
+	int		fd;			/* Input file descriptor. */
+	unsigned int	nstreams;		/* Number of streams interleaved in this input. */
+	stream_t	**streams;		/* The streams, in interleave order. */
+	pthread_t	thread;			/* Input thread. */
+} input_t;
+
+stream_t	*streams [MAX_STREAMS];
+unsigned int	nstreams;
+
+/* Written to by a worker when its stream ends, to wake up the main loop. */
+int	wake_pipe [2];
+
+
+/** @brief  Get the block at the tail of the queue for filling.
+ * @param[io]  Pointer to the stream.
+ * @return  Pointer to BLOCK_SAMPLES samples. Blocks while the queue is full.
+ */
+static float *queue_reserve (stream_t *s)
+{
+	pthread_mutex_lock (&s->lock);
+	while (s->count == QUEUE_BLOCKS) {
+		pthread_cond_wait (&s->not_full, &s->lock);
+	}
+	pthread_mutex_unlock (&s->lock);
+
+	return s->queue [s->tail];
+}
+
+
+/** @brief  Hand the tail block over to the worker.
+ * @param[io]  Pointer to the stream.
+ * @param[in]  Number of samples in the block.
+ */
+static void queue_commit (stream_t *s, unsigned int len)
+{
+	pthread_mutex_lock (&s->lock);
+	s->queue_len [s->tail] = len;
+	s->tail = (s->tail + 1) % QUEUE_BLOCKS;
+	s->count++;
+	pthread_cond_signal (&s->not_empty);
+	pthread_mutex_unlock (&s->lock);
+}
+
+
+/** @brief  Mark the end of the stream.
+ * @param[io]  Pointer to the stream.
+ */
+static void queue_close (stream_t *s)
+{
+	pthread_mutex_lock (&s->lock);
+	s->eof = 1;
+	pthread_cond_signal (&s->not_empty);
+	pthread_mutex_unlock (&s->lock);
+}
+
+
+/** @brief  Get the oldest block in the queue.
+ * @param[io]  Pointer to the stream.
+ * @param[out] Number of samples in the block.
+ * @return  Pointer to the samples or NULL at the end of the stream.
+ */
+static float *queue_peek (stream_t *s, unsigned int *len)
+{
+	float	*block = NULL;
+
+	pthread_mutex_lock (&s->lock);
+	while (s->count == 0 && ! s->eof) {
+		pthread_cond_wait (&s->not_empty, &s->lock);
+	}
+	if (s->count > 0) {
+		block = s->queue [s->head];
+		*len = s->queue_len [s->head];
+	}
+	pthread_mutex_unlock (&s->lock);
+
+	return block;
+}
+
+
+/** @brief  Return the oldest block to the input thread.
+ * @param[io]  Pointer to the stream.
+ */
+static void queue_release (stream_t *s)
+{
+	pthread_mutex_lock (&s->lock);
+	s->head = (s->head + 1) % QUEUE_BLOCKS;
+	s->count--;
+	pthread_cond_signal (&s->not_full);
+	pthread_mutex_unlock (&s->lock);
+}
+
+
+static stream_t *new_stream (int channel)
+{
+	stream_t	*new = calloc (sizeof (*new), 1);
+
+	if (! new) {
+		printf ("Allocation of stream failed\n");
+		exit (1);
+	}
+
+	new->cor = new_correlator (channel);
+	pthread_mutex_init (&new->lock, NULL);
+	pthread_cond_init (&new->not_empty, NULL);
+	pthread_cond_init (&new->not_full, NULL);
+
+	return new;
+}
+
+
+/** @brief  Worker thread running the correlator of one stream.
+ * @param[in]  Pointer to the stream.
+ */
+static void *stream_thread (void *arg)
+{
+	stream_t	*s = arg;
+	float		*v;
+	unsigned int	len;
+
+	while ((v = queue_peek (s, &len))) {
+		stuff_samples (s->cor, v, len);
+		queue_release (s);
+	}
+
+	/* Tell the main loop that this stream has ended. */
+	if (write (wake_pipe [1], "", 1) < 0) {
+		perror ("write: ");
+	}
+
+	return NULL;
+}
+
+
+/** @brief  Input thread reading floats from one file descriptor.
+ * @param[in]  Pointer to the input.
+ *
+ * Sample n of the input belongs to stream (n % nstreams). The samples are
+ * copied straight into the tail block of each stream queue, which is handed
+ * over when it is full or when the samples of one read() are used up.
+ */
+static void *input_thread (void *arg)
+{
+	input_t		*in = arg;
+	uint8_t		input_buffer [65536];
+	unsigned int	input_offset = 0;
+	float		*block [MAX_STREAMS];
+	unsigned int	fill [MAX_STREAMS];
+	unsigned int	cur = 0;
+	unsigned int	y;
+	int		x;
+
+	for (y = 0; y < in->nstreams; y++) {
+		block [y] = queue_reserve (in->streams [y]);
+		fill [y] = 0;
+	}
+
+	while ((x = read (in->fd, &input_buffer [input_offset], sizeof (input_buffer) - input_offset)) > 0) {
+		float	*v = (float *)&input_buffer [0];
+
+		x += input_offset;
+		while (x >= sizeof (*v)) {
+			block [cur][fill [cur]++] = *v;
+			if (fill [cur] == BLOCK_SAMPLES) {
+				queue_commit (in->streams [cur], BLOCK_SAMPLES);
+				block [cur] = queue_reserve (in->streams [cur]);
+				fill [cur] = 0;
+			}
+			if (++cur == in->nstreams) {
+				cur = 0;
+			}
+			x -= sizeof (*v);
+			v++;
+		}
+		input_offset = 0;
+		if (x > 0) {
+			/* Partial read of the last value. Move it to the head of the buffer and prepare for the next batch. */
+			uint8_t	*p = (void *)v;
+			while (x-- > 0) {
+				input_buffer [input_offset++] = *(p++);
+			}
+		}
+
+		/* Hand over partly filled blocks too, so a slow input does not delay the decoding. */
+		for (y = 0; y < in->nstreams; y++) {
+			if (fill [y] > 0) {
+				queue_commit (in->streams [y], fill [y]);
+				block [y] = queue_reserve (in->streams [y]);
+				fill [y] = 0;
+			}
+		}
+	}
+
+	/* End of input. Flush what is left and close the streams. */
+	for (y = 0; y < in->nstreams; y++) {
+		if (fill [y] > 0) {
+			queue_commit (in->streams [y], fill [y]);
+		}
+		queue_close (in->streams [y]);
+	}
+
+	return NULL;
+}
+
+
+static void usage (const char *name)
+{
+	fprintf (stderr, "Usage: %s [-c] [-f] [-n channels] [-p policy] [-q bytes] [input ...]\n"
+			 "  -c           Drop packets failing the CRC check (default is to flag them).\n"
+			 "  -f           Fixed soft symbol gain instead of adaptive scaling.\n"
+			 "  -n channels  Number of streams interleaved in each input (default 1).\n"
+			 "  -p policy    Slow subscriber policy: drop (oldest packets, default),\n"
+			 "               disconnect or block.\n"
+			 "  -q bytes     Send queue size per subscriber (default 65536).\n"
+			 "  input        Demodulated float stream (file or FIFO, - for stdin).\n"
+			 "               Reads a single input from stdin if omitted.\n", name);
+	exit (1);
+}
+
+
+int main (int argc, char **argv)
+{
+	input_t		inputs [MAX_STREAMS];
+	unsigned int	ninputs;
+	unsigned int	channels = 1;
+	int		policy = SEND_DROP_OLDEST;
+	unsigned int	queue_bytes = 65536;
+	unsigned int	ended = 0;
+	unsigned int	x, y;
+	int		opt;
+
+	while ((opt = getopt (argc, argv, "cfn:p:q:h")) != -1) {
+		switch (opt) {
+			case 'c':
+				set_crc_drop (1);
+				break;
+			case 'f':
+				set_soft_scaling (0);
+				break;
+			case 'n':
+				channels = atoi (optarg);
+				break;
+			case 'p':
+				if (strcmp (optarg, "drop") == 0) {
+					policy = SEND_DROP_OLDEST;
+				} else if (strcmp (optarg, "disconnect") == 0) {
+					policy = SEND_DISCONNECT;
+				} else if (strcmp (optarg, "block") == 0) {
+					policy = SEND_BLOCK;
+				} else {
+					usage (argv [0]);
+				}
+				break;
+			case 'q':
+				queue_bytes = atoi (optarg);
+				break;
+			default:
+				usage (argv [0]);
+		}
+	}
+
+	ninputs = (optind < argc) ? argc - optind : 1;
+	if (channels < 1 || ninputs * channels > MAX_STREAMS) {
+		fprintf (stderr, "Between 1 and %d streams are supported\n", MAX_STREAMS);
+		exit (1);
+	}
+
+	/* Ignore SIGPIPE interrupts. */
+	signal (SIGPIPE, SIG_IGN);
+
+	init_trellis_encoder ();
+	init_crc_table ();
+	if (init_sockets () < 0) {
+		exit (1);
+	}
+	set_send_policy (policy, queue_bytes);
+
+	if (pipe (wake_pipe) < 0) {
+		perror ("pipe: ");
+		exit (1);
+	}
+
+	/* Open the inputs and create a correlator per stream. */
+	nstreams = 0;
+	for (x = 0; x < ninputs; x++) {
+		const char	*path = (optind < argc) ? argv [optind + x] : "-";
+
+		if (strcmp (path, "-") == 0) {
+			inputs [x].fd = 0;
+		} else if ((inputs [x].fd = open (path, O_RDONLY)) < 0) {
+			perror (path);
+			exit (1);
+		}
+
+		inputs [x].nstreams = channels;
+		inputs [x].streams = &streams [nstreams];
+		for (y = 0; y < channels; y++) {
+			streams [nstreams] = new_stream (nstreams);
+			nstreams++;
+		}
+	}
+	fprintf (stderr, "Viterbi kernel: %s  Streams: %u\n", viterbi_kernel, nstreams);
+
+	for (x = 0; x < nstreams; x++) {
+		pthread_create (&streams [x]->thread, NULL, stream_thread, streams [x]);
+	}
+	for (x = 0; x < ninputs; x++) {
+		pthread_create (&inputs [x].thread, NULL, input_thread, &inputs [x]);
+	}
+
+	/* Serve the distribution sockets until all streams have ended. */
+	while (ended < nstreams) {
+		int	woken = wait_sockets (wake_pipe [0], -1);
+
+		if (woken < 0) {
+			exit (2);
+		}
+		if (woken) {
+			char	buf [MAX_STREAMS];
+			int	n = read (wake_pipe [0], buf, sizeof (buf));
+
+			if (n > 0) {
+				ended += n;
+			}
+		}
+	}
+
+	for (x = 0; x < ninputs; x++) {
+		pthread_join (inputs [x].thread, NULL);
+	}
+	for (x = 0; x < nstreams; x++) {
+		pthread_join (streams [x]->thread, NULL);
+	}
+
+	return 0;
+}
@@ -0,0 +1,688 @@
+/* -*- c -*- */
+/*
+ * Copyright (c) 2013 Peter Scott, OZ2ABA
+ *
+ * Strx correlator is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx correlator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with strx; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sockets.h"
+
+
+#define SEND_SLOTS	1024		/* Max number of packets queued per client (power of 2). */
+
+/* A decoded packet, shared by the send queues of all subscribers. */
+struct packet {
+	int		refs;		/* Number of queues holding the packet. */
+	int		length;		/* Length of the data. */
+	uint8_t		data [];	/* Packet data. */
+};
+
+struct client {
+	struct client		*prev;		/* Pointer to the previous one in the chain. */
+	struct client		*next;		/* Pointer to the next one in the chain. */
+	int			fd;		/* Socket file descriptor. */
+	int			sockno;		/* Index of the client set this socket belongs to. */
+	int			listening;	/* This is the accept socket of the client set. */
+	int			dead;		/* Dropped, waiting to be freed by the socket loop. */
+	struct packet		*queue [SEND_SLOTS];	/* Packets waiting to be sent. */
+	unsigned int		head;		/* Index of the oldest queued packet. */
+	unsigned int		count;		/* Number of queued packets. */
+	unsigned int		offset;		/* Bytes of the oldest packet already sent. */
+	unsigned int		queued;		/* Number of queued bytes. */
+	unsigned long long	sent;		/* Number of packets sent. */
+	unsigned long long	dropped;	/* Number of packets dropped from the queue. */
+};
+
+struct client_set {
+	struct client		listener;	/* Accept socket. */
+	unsigned long long	packets;	/* Number of packets received on this channel. */
+	unsigned long long	bytes;		/* Number of bytes received on this channel. */
+	unsigned long long	good;		/* Number of packets passing the CRC check. */
+	unsigned long long	bad;		/* Number of packets failing the CRC check. */
+	unsigned long long	corrected;	/* Number of good packets with bit errors corrected by the FEC. */
+	unsigned long long	dropped;	/* Number of packets dropped by slow subscribers. */
+	struct client		*list;		/* List of connected sockets. */
+};
+
+static struct client_set client_set [270];	/* Array of client sockets. */
+
+static uint8_t	last_housekeeping [100];	/* Buffer to hold the last received housekeeping packet. */
+
+static int	epoll_fd = -1;		/* Event queue for all sockets. */
+static int	epoll_wake_fd = -1;	/* Extra descriptor registered by wait_sockets(). */
+
+static struct client	*graveyard;	/* Dropped clients, freed by the socket loop. */
+
+static int		send_policy = SEND_DROP_OLDEST;	/* What to do when a send queue is full. */
+static unsigned int	send_limit = 65536;		/* Max number of queued bytes per client. */
+
+/* Serializes the socket fan-out and packet logging between the decoder threads and the socket loop. */
+static pthread_mutex_t	socket_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled when send queue space is freed, used by the SEND_BLOCK policy. */
+static pthread_cond_t	space_cond = PTHREAD_COND_INITIALIZER;
+
+/* Macro to insert a entry into a list. */
+#define INSERT_INTO_LIST(list,element) do { \
+	element->next = list; \
+	if (element->next) element->next->prev = element; \
+	list = element; \
+} while (0)
+
+/* Macro to remove a entry from a list. */
+#define REMOVE_FROM_LIST(list,element) do { \
+	if (element->prev == NULL) {	/* First element in the list. */ \
+		list = element->next; \
+		if (element->next) element->next->prev = NULL; \
+	} else {	/* Not the first element. */ \
+		element->prev->next = element->next; \
+		if (element->next) element->next->prev = element->prev; \
+	} \
+} while (0)
+
+
+
+/** @brief  Create a listening socket for a client set.
+ * @param[in]  Index of the client set.
+ * @param[in]  TCP port number.
+ * @return  0 on success, -1 on error.
+ */
+static int open_listener (int sockno, int port)
+{
+	struct client		*l = &client_set [sockno].listener;
+	struct sockaddr_in	addr;
+	struct epoll_event	ev;
+	int			opt_val;
+
+	l->fd = socket (AF_INET, SOCK_STREAM, 0);
+	if (l->fd < 0) {
+		perror ("socket: ");
+		return -1;
+	}
+	l->sockno = sockno;
+	l->listening = 1;
+
+	opt_val = 1;
+	setsockopt (l->fd, SOL_SOCKET, SO_REUSEADDR, &opt_val, sizeof (opt_val));
+
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons (port);
+	addr.sin_family = AF_INET;
+	if (bind (l->fd, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+		perror ("bind: ");
+		return -1;
+	}
+
+	if (listen (l->fd, SOMAXCONN) < 0) {
+		perror ("listen: ");
+		return -1;
+	}
+
+	/* Edge triggered, so accept() until it would block. */
+	fcntl (l->fd, F_SETFL, O_NONBLOCK);
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = l;
+	if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, l->fd, &ev) < 0) {
+		perror ("epoll_ctl: ");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/** @brief  Create the listening sockets.
+ * @return  0 on success, -1 if a socket could not be set up.
+ */
+int init_sockets (void)
+{
+	int	x;
+
+	memset (client_set, 0, sizeof (client_set));
+	graveyard = NULL;
+	epoll_wake_fd = -1;
+
+	epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror ("epoll_create1: ");
+		return -1;
+	}
+
+	/* Create a listening socket for the first 32 slots. */
+	for (x = 0; x < 32; x++) {
+		if (open_listener (x, 4000 + x) < 0) {
+			return -1;
+		}
+	}
+
+	/* Create a listening socket for the command port. */
+	if (open_listener (260, 5000) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static int dump_telemetry (int fd)
+{
+	char		buf [32768];
+	char		*bc = buf;
+	uint32_t	upt = last_housekeeping [1] + (last_housekeeping [2] << 8) + (last_housekeeping [3] << 16) + (last_housekeeping [4] << 24);
+	float		vbat = ((24.9+4.7)/4.7) * (last_housekeeping [5] + (last_housekeeping [6] << 8)) * (3.3 / 4095.0);
+	int		x;
+
+	/* Forst dump some info from the housekeeping block. */
+	bc += sprintf (bc, "TX: %d  Uptime: %d.%d  Vbat: %5.2f  Flags: %04X",
+			   last_housekeeping [0],
+			   upt / 10, upt % 10,
+			   vbat,
+			   last_housekeeping [7] + (last_housekeeping [8] << 8));
+
+	for (x = 0; x < 256; x++) {
+		if (client_set [x].packets > 0 || client_set [x].bad > 0) {
+			bc += sprintf (bc, "\t%d:%llu,%llu,%llu,%llu,%llu,%llu", x, client_set [x].packets, client_set [x].bytes,
+				       client_set [x].good, client_set [x].bad, client_set [x].corrected, client_set [x].dropped);
+		}
+	}
+	bc += sprintf (bc, "\n");
+
+	return send (fd, buf, (bc - buf), MSG_NOSIGNAL);
+}
+
+
+/** @brief  Remove a packet from a send queue.
+ * @param[io]  Pointer to the client.
+ * @param[in]  Queue index of the packet, either the head or the one after it.
+ *
+ * Removing the packet after the head is used when the head is partly sent
+ * and must be completed.
+ */
+static void release_packet (struct client *c, unsigned int index)
+{
+	struct packet	*p = c->queue [index % SEND_SLOTS];
+
+	if (index != c->head) {
+		c->queue [index % SEND_SLOTS] = c->queue [c->head % SEND_SLOTS];
+	}
+	c->head++;
+	c->count--;
+	c->queued -= p->length;
+
+	if (--p->refs == 0) {
+		free (p);
+	}
+}
+
+
+/** @brief  Drop a client.
+ * @param[io]  Pointer to the client.
+ *
+ * The socket is closed right away, which also removes it from the event
+ * queue, but the memory is only freed by the socket loop since events for
+ * the client may still be pending there.
+ */
+static void drop_client (struct client *c)
+{
+	while (c->count > 0) {
+		release_packet (c, c->head);
+	}
+	if (c->sockno != 260) {
+		fprintf (stderr, "Subscriber on port %d closed: %llu packets sent, %llu dropped\n",
+			 4000 + c->sockno, c->sent, c->dropped);
+	}
+	close (c->fd);
+	REMOVE_FROM_LIST (client_set [c->sockno].list, c);
+	c->dead = 1;
+	c->next = graveyard;
+	graveyard = c;
+
+	/* A writer may be blocked on this client. */
+	pthread_cond_broadcast (&space_cond);
+}
+
+
+/** @brief  Accept all pending connections on a listening socket.
+ * @param[in]  Pointer to the listening socket.
+ */
+static void accept_clients (struct client *l)
+{
+	struct epoll_event	ev;
+	int			fd;
+
+	while ((fd = accept (l->fd, NULL, NULL)) >= 0) {
+		/* Create a new client. */
+		struct client	*c = calloc (1, sizeof (*c));
+
+		if (! c) {
+			close (fd);
+			continue;
+		}
+		c->fd = fd;
+		c->sockno = l->sockno;
+
+		/* Make socket non-blocking. */
+		fcntl (c->fd, F_SETFL, O_NONBLOCK);
+
+		/* EPOLLOUT fires whenever the socket drains after the send queue was in use. */
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+			perror ("epoll_ctl: ");
+			close (c->fd);
+			free (c);
+			continue;
+		}
+
+		/* Insert at the head of the list. */
+		INSERT_INTO_LIST (client_set [l->sockno].list, c);
+	}
+}
+
+
+/** @brief  Send as much of the queued data as the socket will take.
+ * @param[io]  Pointer to the client.
+ * @return  0 on success or if the socket is full, -1 on error.
+ */
+static int flush_client (struct client *c)
+{
+	struct iovec	iov [64];
+	unsigned int	n;
+	unsigned int	x;
+	ssize_t		y;
+
+	while (c->count > 0) {
+		/* Gather the queued packets, skipping what has already been sent. */
+		n = (c->count < 64) ? c->count : 64;
+		for (x = 0; x < n; x++) {
+			struct packet	*p = c->queue [(c->head + x) % SEND_SLOTS];
+
+			iov [x].iov_base = p->data;
+			iov [x].iov_len = p->length;
+		}
+		iov [0].iov_base = (uint8_t *)iov [0].iov_base + c->offset;
+		iov [0].iov_len -= c->offset;
+
+		y = writev (c->fd, iov, n);
+		if (y < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return -1;
+		}
+
+		/* Release the packets sent completely. */
+		while (c->count > 0 && y >= (ssize_t)(c->queue [c->head % SEND_SLOTS]->length - c->offset)) {
+			y -= c->queue [c->head % SEND_SLOTS]->length - c->offset;
+			c->offset = 0;
+			c->sent++;
+			release_packet (c, c->head);
+		}
+		c->offset += y;
+
+		if (send_policy == SEND_BLOCK) {
+			pthread_cond_broadcast (&space_cond);
+		}
+	}
+
+	return 0;
+}
+
+
+/** @brief  Check whether a packet fits in the send queue of a client.
+ * @param[in]  Pointer to the client.
+ * @param[in]  Length of the packet.
+ * @return  1 if the queue is full.
+ *
+ * A packet always fits in an empty queue.
+ */
+static int queue_full (const struct client *c, int length)
+{
+	return c->count == SEND_SLOTS || (c->count > 0 && c->queued + length > send_limit);
+}
+
+
+/** @brief  Handle an event on a client socket.
+ * @param[io]  Pointer to the client.
+ * @param[in]  The epoll events.
+ *
+ * Data sent by packet subscribers is just flushed. Anything received on
+ * the monitor port is answered with the telemetry status.
+ */
+static void service_client (struct client *c, uint32_t events)
+{
+	char	buf [4096];
+	int	received = 0;
+	int	y;
+
+	if (events & EPOLLERR) {
+		drop_client (c);
+		return;
+	}
+
+	if ((events & EPOLLOUT) && flush_client (c) < 0) {
+		drop_client (c);
+		return;
+	}
+
+	if (! (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+		return;
+	}
+
+	/* Edge triggered, so read until it would block. */
+	while ((y = recv (c->fd, &buf, sizeof (buf), 0)) > 0) {
+		received = 1;
+	}
+
+	if (y == 0 || (y < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		/* EOF or read error. Ditch this user. */
+		drop_client (c);
+		return;
+	}
+
+	if (received && c->sockno == 260) {
+		/* Something received. Dump telemetry status. */
+		if (dump_telemetry (c->fd) < 0) {
+			/* Monitor client disappeared. Close down. */
+			drop_client (c);
+		}
+	}
+}
+
+
+/** @brief  Select how slow subscribers are handled.
+ * @param[in]  One of the SEND_ policies.
+ * @param[in]  Max number of bytes queued per subscriber.
+ */
+void set_send_policy (int policy, unsigned int queue_bytes)
+{
+	pthread_mutex_lock (&socket_lock);
+	send_policy = policy;
+	send_limit = queue_bytes;
+	pthread_mutex_unlock (&socket_lock);
+}
+
+
+/** @brief  Send a packet to all subscribers of a port.
+ * @param[in]  Port number (packet ID).
+ * @param[in]  Length of the data.
+ * @param[in]  Pointer to the data.
+ *
+ * Must be called with the socket lock held. The packet is sent right away
+ * to the subscribers that keep up, and queued as a whole for the rest to be
+ * sent by the socket loop, so a subscriber never receives a partial packet.
+ * With the SEND_BLOCK policy the caller waits here until every subscriber
+ * has room for the packet.
+ */
+void write_socket (int sockno, int length, uint8_t *data)
+{
+	/* Send the packet to all subscribers of the sockno value. */
+	struct client	*cnext;
+	struct client	*c;
+	struct packet	*p;
+	int		x;
+
+	client_set [sockno].packets++;
+	client_set [sockno].bytes += length;
+
+	if (send_policy == SEND_BLOCK) {
+		/* The list may change while waiting, so check it all over again. */
+		do {
+			for (c = client_set [sockno].list; c; c = c->next) {
+				if (queue_full (c, length)) {
+					pthread_cond_wait (&space_cond, &socket_lock);
+					break;
+				}
+			}
+		} while (c);
+	}
+
+	p = malloc (sizeof (*p) + length);
+	if (! p) {
+		return;
+	}
+	p->refs = 1;
+	p->length = length;
+	memcpy (p->data, data, length);
+
+	cnext = client_set [sockno].list;
+	while ((c = cnext)) {
+		cnext = c->next;
+
+		x = 0;
+		if (c->count == 0) {
+			/* Nothing queued, try to send it right away. */
+			x = send (c->fd, data, length, MSG_NOSIGNAL);
+			if (x == length) {
+				c->sent++;
+				continue;
+			}
+			if (x < 0) {
+				if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+					/* The socket died. Clean up. */
+					drop_client (c);
+					continue;
+				}
+				x = 0;
+			}
+		}
+
+		while (queue_full (c, length)) {
+			/* The head is kept if it is partly sent. */
+			unsigned int	oldest = c->head + (c->offset > 0);
+
+			if (send_policy == SEND_DISCONNECT) {
+				break;
+			}
+			if (oldest == c->head + c->count) {
+				break;		/* Only the partly sent packet left. */
+			}
+			release_packet (c, oldest);
+			c->dropped++;
+			client_set [sockno].dropped++;
+		}
+		if (queue_full (c, length) && send_policy == SEND_DISCONNECT) {
+			drop_client (c);
+			continue;
+		}
+
+		if (c->count == SEND_SLOTS) {
+			c->dropped++;
+			client_set [sockno].dropped++;
+			continue;
+		}
+
+		/* Queue the rest of the packet. */
+		c->queue [(c->head + c->count) % SEND_SLOTS] = p;
+		if (c->count == 0) {
+			c->offset = x;
+		}
+		c->count++;
+		c->queued += length;
+		p->refs++;
+	}
+
+	if (--p->refs == 0) {
+		free (p);
+	}
+}
+
+
+/** @brief  Keep the last housekeeping packet for the monitor port.
+ * @param[in]  Pointer to the packet, starting with the ID byte.
+ * @param[in]  Length of the packet.
+ *
+ * Must be called with the socket lock held.
+ */
+void set_housekeeping (const uint8_t *data, int length)
+{
+	if (length > sizeof (last_housekeeping)) {
+		length = sizeof (last_housekeeping);
+	}
+	memcpy (last_housekeeping, data, length);
+}
+
+
+/** @brief  Update the packet acceptance statistics of a packet ID.
+ * @param[in]  Packet ID.
+ * @param[in]  Non-zero if the packet passed the CRC check.
+ * @param[in]  Non-zero if the FEC corrected bit errors in the packet.
+ *
+ * Must be called with the socket lock held.
+ */
+void count_packet (int sockno, int crc_ok, int corrected)
+{
+	if (crc_ok) {
+		client_set [sockno].good++;
+		if (corrected) {
+			client_set [sockno].corrected++;
+		}
+	} else {
+		client_set [sockno].bad++;
+	}
+}
+
+
+void lock_sockets (void)
+{
+	pthread_mutex_lock (&socket_lock);
+}
+
+
+void unlock_sockets (void)
+{
+	pthread_mutex_unlock (&socket_lock);
+}
+
+
+/** @brief  Wait for socket activity and serve it.
+ * @param[in]  Additional file descriptor to wait for, or -1.
+ * @param[in]  Timeout in milliseconds, or -1 to wait forever.
+ * @return  1 if wake_fd is readable, 0 otherwise and -1 on error.
+ *
+ * Only the sockets with pending events are visited, so the cost does not
+ * grow with the number of connected subscribers. The samples are read and
+ * decoded by other threads, which only contend for the socket lock while
+ * the events are handled.
+ */
+int wait_sockets (int wake_fd, int timeout_ms)
+{
+	struct epoll_event	events [64];
+	struct client		*c;
+	int			n;
+	int			x;
+	int			woken = 0;
+
+	/* Free the clients dropped since the last round. */
+	pthread_mutex_lock (&socket_lock);
+	while ((c = graveyard)) {
+		graveyard = c->next;
+		free (c);
+	}
+	pthread_mutex_unlock (&socket_lock);
+
+	if (wake_fd != epoll_wake_fd) {
+		struct epoll_event	ev;
+
+		/* Level triggered, the caller drains it. */
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_wake_fd >= 0) {
+			epoll_ctl (epoll_fd, EPOLL_CTL_DEL, epoll_wake_fd, &ev);
+		}
+		if (wake_fd >= 0 && epoll_ctl (epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+			perror ("epoll_ctl: ");
+			return -1;
+		}
+		epoll_wake_fd = wake_fd;
+	}
+
+	n = epoll_wait (epoll_fd, events, sizeof (events) / sizeof (events [0]), timeout_ms);
+
+	if (n == -1) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return 0;	/* Interrupted system call. Just retry. */
+		}
+		perror ("epoll_wait: ");
+		return -1;
+	}
+
+	pthread_mutex_lock (&socket_lock);
+	for (x = 0; x < n; x++) {
+		c = events [x].data.ptr;
+
+		if (c == NULL) {
+			woken = 1;
+		} else if (c->listening) {
+			accept_clients (c);
+		} else if (! c->dead) {
+			service_client (c, events [x].events);
+		}
+	}
+	pthread_mutex_unlock (&socket_lock);
+
+	return woken;
+}
+
+
+/** @brief  Close all sockets and drop the subscribers.
+ */
+void close_sockets (void)
+{
+	struct client	*c;
+	int		x;
+
+	pthread_mutex_lock (&socket_lock);
+	for (x = 0; x < 270; x++) {
+		while ((c = client_set [x].list)) {
+			drop_client (c);
+		}
+		if (client_set [x].listener.listening) {
+			close (client_set [x].listener.fd);
+		}
+	}
+	while ((c = graveyard)) {
+		graveyard = c->next;
+		free (c);
+	}
+	pthread_cond_broadcast (&space_cond);
+	memset (client_set, 0, sizeof (client_set));
+	if (epoll_fd >= 0) {
+		close (epoll_fd);
+		epoll_fd = -1;
+	}
+	epoll_wake_fd = -1;
+	pthread_mutex_unlock (&socket_lock);
+}
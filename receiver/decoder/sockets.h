@@ -0,0 +1,66 @@
+/* -*- c -*- */
+/*
+ * Copyright (c) 2013 Peter Scott, OZ2ABA
+ *
+ * Strx correlator is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx correlator is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with strx; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef SOCKETS_H
+#define SOCKETS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @brief  Packet distribution sockets.
+ *
+ * Decoded packets are distributed to TCP subscribers on port 4000 + ID for
+ * the first 32 packet IDs. Port 5000 is the monitor port, which answers
+ * every received byte with the housekeeping and throughput status.
+ *
+ * The socket state is shared by all correlators in the process. Packets are
+ * delivered from the decoder threads with the socket lock held, while one
+ * thread serves the sockets by calling wait_sockets() in a loop.
+ *
+ * Each subscriber has a bounded send queue, flushed by the socket loop
+ * when the socket drains. The send policy selects what happens when the
+ * queue of a slow subscriber is full.
+ */
+
+enum {
+	SEND_DROP_OLDEST,	/* Drop the oldest queued packets (default). */
+	SEND_DISCONNECT,	/* Disconnect the subscriber. */
+	SEND_BLOCK		/* Wait for the subscriber, stalling the decoder. */
+};
+
+int  init_sockets (void);
+void close_sockets (void);
+int  wait_sockets (int wake_fd, int timeout_ms);
+
+void set_send_policy (int policy, unsigned int queue_bytes);
+
+void lock_sockets (void);
+void unlock_sockets (void);
+void write_socket (int sockno, int length, uint8_t *data);
+void set_housekeeping (const uint8_t *data, int length);
+void count_packet (int sockno, int crc_ok, int corrected);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SOCKETS_H */
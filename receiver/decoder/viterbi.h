@@ -11,6 +11,8 @@
 #include <math.h>
 #include <time.h>
 #include <memory.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/resource.h>
 
 //#include "verify_viterbi.h"
@@ -135,7 +137,7 @@ typedef union {
   COMPUTETYPE t[NUMSTATES];
 } metric_t __attribute__ ((aligned (16)));
 
-inline void renormalize(COMPUTETYPE* X, COMPUTETYPE threshold){
+static inline void renormalize(COMPUTETYPE* X, COMPUTETYPE threshold){
   if (X[0]>threshold){
     int i;
     COMPUTETYPE min=X[0];
@@ -148,6 +150,14 @@ inline void renormalize(COMPUTETYPE* X, COMPUTETYPE threshold){
 }
 
 COMPUTETYPE Branchtab[NUMSTATES/2*RATE] __attribute__ ((aligned (16)));
+short Branchtab16[NUMSTATES/2*RATE] __attribute__ ((aligned (32))); /* Branchtab as 16 bit lanes for the SIMD kernels */
+
+/* Block update function, selected at run time by select_viterbi_kernel() */
+typedef int (*update_viterbi_blk_t)(void *p, COMPUTETYPE *syms, int nbits);
+int update_viterbi_blk_GENERIC(void *p, COMPUTETYPE *syms, int nbits);
+update_viterbi_blk_t update_viterbi_blk = update_viterbi_blk_GENERIC;
+const char *viterbi_kernel = "generic";
+static void select_viterbi_kernel(void);
 
 /* State info for instance of Viterbi decoder
  */
@@ -186,8 +196,10 @@ struct v *create_viterbi(int len){
     for(state=0;state < NUMSTATES/2;state++){
       for (i=0; i<RATE; i++){
         Branchtab[i*NUMSTATES/2+state] = (polys[i] < 0) ^ parity((2*state) & abs(polys[i])) ? 255 : 0;
+        Branchtab16[i*NUMSTATES/2+state] = Branchtab[i*NUMSTATES/2+state];
       }
     }
+    select_viterbi_kernel();
     Init++;
   }
 
@@ -290,8 +302,6 @@ void BFLY(int i, int s, COMPUTETYPE * syms, struct v * vp, decision_t * d) {
  * Note that nbits is the number of decoded data bits, not the number
  * of symbols!
  */
-    COMPUTETYPE max_spread = 0;
-
 int update_viterbi_blk_GENERIC(void *p, COMPUTETYPE *syms,int nbits){
   struct v *vp = p;
 
@@ -311,18 +321,6 @@ int update_viterbi_blk_GENERIC(void *p, COMPUTETYPE *syms,int nbits){
       BFLY(i, s, syms, vp, vp->decisions);
     }
 
-    COMPUTETYPE min=vp->new_metrics->t[0];
-    COMPUTETYPE max=vp->new_metrics->t[0];
-    
-    /* Compute Spread */
-    for(i=0;i<NUMSTATES;i++)
-      if (min>vp->new_metrics->t[i]) 
-        min=vp->new_metrics->t[i];
-      else if (max<vp->new_metrics->t[i])
-        max=vp->new_metrics->t[i];
-    if (max_spread<max-min)
-      max_spread=max-min;
-
     renormalize(vp->new_metrics->t, RENORMALIZE_THRESHOLD);
     
     ///     Swap pointers to old and new metrics
@@ -334,3 +332,209 @@ int update_viterbi_blk_GENERIC(void *p, COMPUTETYPE *syms,int nbits){
   return 0;
 }
 
+
+
+/* SIMD add-compare-select kernels (x86 SSE2 and AVX2).
+ *
+ * The path metrics are held as 16 bit integers for the duration of a block
+ * and renormalized against the best state after every bit. With K=7 and
+ * 8 bit soft symbols the spread between the best and the worst state can
+ * not exceed (K-1)*RATE*255, so the saturating arithmetic never actually
+ * saturates and the decisions are bit-identical to the generic kernel.
+ * Symbols outside 0..255 are clamped on load.
+ *
+ * For each butterfly i the two survivors go to the new states 2i and 2i+1,
+ * so interleaving the two decision vectors gives the decision bits in new
+ * state order, which is exactly what movemask needs to pack them.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VITERBI_HAVE_SIMD 1
+#include <immintrin.h>
+
+static inline short clamp_symbol(COMPUTETYPE sym){
+  int s = (int)sym;
+  return s < 0 ? 0 : (s > 255 ? 255 : s);
+}
+
+__attribute__ ((target ("sse2")))
+static inline __m128i hmin_epi16(__m128i v){
+  v = _mm_min_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2)));
+  v = _mm_min_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2,3,0,1)));
+  v = _mm_min_epi16(v, _mm_shufflelo_epi16(v, _MM_SHUFFLE(2,3,0,1)));
+  return _mm_shuffle_epi32(_mm_shufflelo_epi16(v, 0), 0);
+}
+
+/* Load the 32 bit path metrics into 16 bit lanes, relative to the best state */
+static void load_metrics16(struct v *vp, short *m){
+  COMPUTETYPE min = vp->old_metrics->t[0];
+  int i;
+
+  for(i=1;i<NUMSTATES;i++)
+    if (min>vp->old_metrics->t[i])
+      min=vp->old_metrics->t[i];
+  for(i=0;i<NUMSTATES;i++){
+    COMPUTETYPE x = vp->old_metrics->t[i] - min;
+    m[i] = x > 0x7FFF ? 0x7FFF : x;
+  }
+}
+
+static void store_metrics16(struct v *vp, const short *m){
+  int i;
+
+  for(i=0;i<NUMSTATES;i++)
+    vp->old_metrics->t[i] = m[i];
+}
+
+__attribute__ ((target ("sse2")))
+int update_viterbi_blk_SSE2(void *p, COMPUTETYPE *syms, int nbits){
+  struct v *vp = p;
+  short mbuf[NUMSTATES] __attribute__ ((aligned (16)));
+  __m128i m[NUMSTATES/8], n[NUMSTATES/8], bt0[NUMSTATES/16], bt1[NUMSTATES/16];
+  const __m128i maxm = _mm_set1_epi16(RATE*255);
+  int s,g;
+
+  if(p == NULL)
+    return -1;
+
+  load_metrics16(vp, mbuf);
+  for(g=0;g<NUMSTATES/8;g++)
+    m[g] = _mm_load_si128((__m128i *)&mbuf[8*g]);
+  for(g=0;g<NUMSTATES/16;g++){
+    bt0[g] = _mm_load_si128((__m128i *)&Branchtab16[8*g]);
+    bt1[g] = _mm_load_si128((__m128i *)&Branchtab16[NUMSTATES/2+8*g]);
+  }
+
+  for (s=0;s<nbits;s++){
+    const __m128i sym0 = _mm_set1_epi16(clamp_symbol(syms[s*RATE]));
+    const __m128i sym1 = _mm_set1_epi16(clamp_symbol(syms[s*RATE+1]));
+    uint64_t dec = 0;
+    __m128i mn;
+
+    for(g=0;g<NUMSTATES/16;g++){
+      __m128i bm = _mm_add_epi16(_mm_xor_si128(bt0[g], sym0), _mm_xor_si128(bt1[g], sym1));
+      __m128i nbm = _mm_sub_epi16(maxm, bm);
+      __m128i m0 = _mm_adds_epi16(m[g], bm);
+      __m128i m1 = _mm_adds_epi16(m[g+NUMSTATES/16], nbm);
+      __m128i m2 = _mm_adds_epi16(m[g], nbm);
+      __m128i m3 = _mm_adds_epi16(m[g+NUMSTATES/16], bm);
+      __m128i d0 = _mm_cmpgt_epi16(m0, m1);
+      __m128i d1 = _mm_cmpgt_epi16(m2, m3);
+      __m128i s0 = _mm_min_epi16(m0, m1);
+      __m128i s1 = _mm_min_epi16(m2, m3);
+
+      n[2*g]   = _mm_unpacklo_epi16(s0, s1);
+      n[2*g+1] = _mm_unpackhi_epi16(s0, s1);
+      dec |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_packs_epi16(_mm_unpacklo_epi16(d0, d1),
+                                                                  _mm_unpackhi_epi16(d0, d1))) << (16*g);
+    }
+    vp->decisions[s].w[0] = (unsigned int)dec;
+    vp->decisions[s].w[1] = (unsigned int)(dec >> 32);
+
+    /* Renormalize against the best state */
+    mn = n[0];
+    for(g=1;g<NUMSTATES/8;g++)
+      mn = _mm_min_epi16(mn, n[g]);
+    mn = hmin_epi16(mn);
+    for(g=0;g<NUMSTATES/8;g++)
+      m[g] = _mm_sub_epi16(n[g], mn);
+  }
+
+  for(g=0;g<NUMSTATES/8;g++)
+    _mm_store_si128((__m128i *)&mbuf[8*g], m[g]);
+  store_metrics16(vp, mbuf);
+
+  return 0;
+}
+
+__attribute__ ((target ("avx2")))
+int update_viterbi_blk_AVX2(void *p, COMPUTETYPE *syms, int nbits){
+  struct v *vp = p;
+  short mbuf[NUMSTATES] __attribute__ ((aligned (32)));
+  __m256i m[NUMSTATES/16], n[NUMSTATES/16], bt0[NUMSTATES/32], bt1[NUMSTATES/32];
+  const __m256i maxm = _mm256_set1_epi16(RATE*255);
+  int s,g;
+
+  if(p == NULL)
+    return -1;
+
+  load_metrics16(vp, mbuf);
+  for(g=0;g<NUMSTATES/16;g++)
+    m[g] = _mm256_load_si256((__m256i *)&mbuf[16*g]);
+  for(g=0;g<NUMSTATES/32;g++){
+    bt0[g] = _mm256_load_si256((__m256i *)&Branchtab16[16*g]);
+    bt1[g] = _mm256_load_si256((__m256i *)&Branchtab16[NUMSTATES/2+16*g]);
+  }
+
+  for (s=0;s<nbits;s++){
+    const __m256i sym0 = _mm256_set1_epi16(clamp_symbol(syms[s*RATE]));
+    const __m256i sym1 = _mm256_set1_epi16(clamp_symbol(syms[s*RATE+1]));
+    __m256i mn;
+    __m128i mn128;
+
+    for(g=0;g<NUMSTATES/32;g++){
+      __m256i bm = _mm256_add_epi16(_mm256_xor_si256(bt0[g], sym0), _mm256_xor_si256(bt1[g], sym1));
+      __m256i nbm = _mm256_sub_epi16(maxm, bm);
+      __m256i m0 = _mm256_adds_epi16(m[g], bm);
+      __m256i m1 = _mm256_adds_epi16(m[g+NUMSTATES/32], nbm);
+      __m256i m2 = _mm256_adds_epi16(m[g], nbm);
+      __m256i m3 = _mm256_adds_epi16(m[g+NUMSTATES/32], bm);
+      __m256i d0 = _mm256_cmpgt_epi16(m0, m1);
+      __m256i d1 = _mm256_cmpgt_epi16(m2, m3);
+      __m256i s0 = _mm256_min_epi16(m0, m1);
+      __m256i s1 = _mm256_min_epi16(m2, m3);
+      __m256i lo, hi, dlo, dhi;
+
+      /* unpack works within 128 bit lanes, so swap the middle quarters back */
+      lo = _mm256_unpacklo_epi16(s0, s1);
+      hi = _mm256_unpackhi_epi16(s0, s1);
+      n[2*g]   = _mm256_permute2x128_si256(lo, hi, 0x20);
+      n[2*g+1] = _mm256_permute2x128_si256(lo, hi, 0x31);
+
+      lo = _mm256_unpacklo_epi16(d0, d1);
+      hi = _mm256_unpackhi_epi16(d0, d1);
+      dlo = _mm256_permute2x128_si256(lo, hi, 0x20);
+      dhi = _mm256_permute2x128_si256(lo, hi, 0x31);
+      vp->decisions[s].w[g] = _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(dlo, dhi),
+                                                                            _MM_SHUFFLE(3,1,2,0)));
+    }
+
+    /* Renormalize against the best state */
+    mn = n[0];
+    for(g=1;g<NUMSTATES/16;g++)
+      mn = _mm256_min_epi16(mn, n[g]);
+    mn128 = _mm_min_epi16(_mm256_castsi256_si128(mn), _mm256_extracti128_si256(mn, 1));
+    mn = _mm256_broadcastw_epi16(hmin_epi16(mn128));
+    for(g=0;g<NUMSTATES/16;g++)
+      m[g] = _mm256_sub_epi16(n[g], mn);
+  }
+
+  for(g=0;g<NUMSTATES/16;g++)
+    _mm256_store_si256((__m256i *)&mbuf[16*g], m[g]);
+  store_metrics16(vp, mbuf);
+
+  return 0;
+}
+#endif
+
+/* Pick the fastest block update the CPU supports. The choice can be
+ * overridden with VITERBI_KERNEL=generic|sse2|avx2 in the environment.
+ */
+static void select_viterbi_kernel(void){
+  const char *req = getenv("VITERBI_KERNEL");
+
+  update_viterbi_blk = update_viterbi_blk_GENERIC;
+  viterbi_kernel = "generic";
+  if (req != NULL && strcmp(req, "generic") == 0)
+    return;
+
+#ifdef VITERBI_HAVE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && (req == NULL || strcmp(req, "avx2") == 0)){
+    update_viterbi_blk = update_viterbi_blk_AVX2;
+    viterbi_kernel = "avx2";
+  } else if (__builtin_cpu_supports("sse2")){
+    update_viterbi_blk = update_viterbi_blk_SSE2;
+    viterbi_kernel = "sse2";
+  }
+#endif
+}
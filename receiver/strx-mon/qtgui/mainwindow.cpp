@@ -50,6 +50,8 @@ MainWindow::MainWindow(Ice::ObjectPrx ice_prx, QString host, QWidget *parent) :
     // create control-port instance
     ctrlport = GNURadio::ControlPortPrx::checkedCast(ice_prx);
     makeParamList();
+    fft_gen = -1;
+    fft_zoom = 1;
 
     // start statistics client
     stats = new CStatisticsClient(host, 5000, parent);
@@ -87,13 +89,16 @@ void MainWindow::makeParamList(void)
     id_list_all.push_back("strx::channel");
     id_list_all.push_back("strx::iqrec");
 
-    id_list_fft.push_back("strx::fft");
+    id_list_fft.push_back("strx::fftgen");
     id_list_fft.push_back("strx::snn");
 
+    id_list_spec.push_back("strx::fft");
+
     id_list_read.push_back("strx::frequency");
     id_list_read.push_back("strx::offset");
     id_list_read.push_back("strx::cutoff");
     id_list_read.push_back("strx_source_c0::gain");
+    id_list_read.push_back("strx::fftzoom");
 
     id_list_filt.push_back("strx::offset");
     id_list_filt.push_back("strx::cutoff");
@@ -102,6 +107,10 @@ void MainWindow::makeParamList(void)
     id_list_ctl.push_back("strx::channel");
 
     id_list_rf.push_back("strx_source_c0::gain");
+
+    id_list_rate.push_back("strx::fftrate");
+
+    id_list_zoom.push_back("strx::fftzoom");
 }
 
 void MainWindow::refresh(void)
@@ -109,19 +118,34 @@ void MainWindow::refresh(void)
     GNURadio::KnobMap knob_map; // map<string, GNURadio::KnobPtr>
     GNURadio::KnobPtr  knob;
     GNURadio::KnobDPtr knob_d;
+    GNURadio::KnobLPtr knob_l;
     GNURadio::KnobVecFPtr knob_fft;
+    bool new_fft = true;
 
     cb_counter++;
 
-    // FFT is refreshed in each cycle
+    // FFT is refreshed in each cycle, but only fetched when it has changed
+    // (receivers without FFT generation are always asked for the FFT)
     knob_map = ctrlport->get(id_list_fft);
 
-    knob = knob_map["strx::fft"];
-    knob_fft = (GNURadio::KnobVecFPtr)(knob);
-    if (knob_fft->value.size())
+    if (knob_map.count("strx::fftgen"))
+    {
+        knob_l = (GNURadio::KnobLPtr)(knob_map["strx::fftgen"]);
+        new_fft = (knob_l->value != fft_gen);
+        fft_gen = knob_l->value;
+    }
+
+    if (new_fft)
     {
-        ui->plotter->setNewFttData(&knob_fft->value[0], knob_fft->value.size());
+        GNURadio::KnobMap fft_map = ctrlport->get(id_list_spec);
+
+        knob_fft = (GNURadio::KnobVecFPtr)(fft_map["strx::fft"]);
+        if (knob_fft && knob_fft->value.size())
+        {
+            ui->plotter->setNewFttData(&knob_fft->value[0], knob_fft->value.size());
+        }
     }
+
     knob = knob_map["strx::snn"];
     knob_d = (GNURadio::KnobDPtr)(knob);
     ui->snrLabel->setText(QString("%1 dB").arg(knob_d->value, 4, 'f', 1));
@@ -135,7 +159,7 @@ void MainWindow::refresh(void)
 
         knob = knob_map["strx::offset"];
         knob_d = (GNURadio::KnobDPtr)(knob);
-        ui->plotter->setFilterOffset((qint64)knob_d->value);
+        qint64 offset = (qint64)knob_d->value;
 
         knob = knob_map["strx::cutoff"];
         knob_d = (GNURadio::KnobDPtr)(knob);
@@ -144,7 +168,35 @@ void MainWindow::refresh(void)
 
         knob = knob_map["strx::frequency"];
         knob_d = (GNURadio::KnobDPtr)(knob);
-        ui->plotter->setCenterFreq((qint64)knob_d->value);
+        qint64 freq = (qint64)knob_d->value;
+
+        int zoom = 1;
+        if (knob_map.count("strx::fftzoom"))
+        {
+            GNURadio::KnobIPtr knob_i = (GNURadio::KnobIPtr)(knob_map["strx::fftzoom"]);
+            zoom = knob_i->value;
+        }
+
+        if (zoom != fft_zoom)
+        {
+            // zoomed FFT covers 1/zoom of the band
+            fft_zoom = zoom;
+            ui->plotter->setSampleRate(4.e6 / zoom);
+            ui->plotter->setSpanFreq(4e6 / zoom);
+            ui->plotter->setFftCenterFreq(0);
+        }
+
+        if (zoom > 1)
+        {
+            // zoomed FFT is centered on the channel
+            ui->plotter->setCenterFreq(freq + offset);
+            ui->plotter->setFilterOffset(0);
+        }
+        else
+        {
+            ui->plotter->setCenterFreq(freq);
+            ui->plotter->setFilterOffset(offset);
+        }
 
         knob = knob_map["strx_source_c0::gain"];
         knob_d = (GNURadio::KnobDPtr)(knob);
@@ -293,6 +345,40 @@ void MainWindow::on_fftCombo_currentIndexChanged(int index)
     {
         // restart timer
         dataTimer->start(1000/fps);
+
+        // let the receiver compute no more frames than we display
+        GNURadio::KnobMap  knob_map;
+        GNURadio::KnobLPtr knob_l;
+
+        knob_map = ctrlport->get(id_list_rate);
+        if (knob_map.count("strx::fftrate"))
+        {
+            knob_l = (GNURadio::KnobLPtr)(knob_map["strx::fftrate"]);
+            knob_l->value = fps;
+            ctrlport->set(knob_map);
+        }
+    }
+}
+
+/*! \brief FFT zoom has changed.
+ *  \param index Index of the newly selected item in the combo box (unused)
+ */
+void MainWindow::on_zoomCombo_currentIndexChanged(int index)
+{
+    Q_UNUSED(index);
+
+    GNURadio::KnobMap  knob_map; // map<string, GNURadio::KnobPtr>
+    GNURadio::KnobIPtr knob_i;
+    QString strval = ui->zoomCombo->currentText();
+
+    strval.remove("x");
+
+    knob_map = ctrlport->get(id_list_zoom);
+    if (knob_map.count("strx::fftzoom"))
+    {
+        knob_i = (GNURadio::KnobIPtr)(knob_map["strx::fftzoom"]);
+        knob_i->value = strval.toInt();
+        ctrlport->set(knob_map);
     }
 }
 
@@ -45,15 +45,20 @@ private:
 
     GNURadio::ControlPortPrx ctrlport;
     GNURadio::KnobIDList     id_list_all;  // vector<string>
-    GNURadio::KnobIDList     id_list_fft;  // FFT only (fast refresh)
+    GNURadio::KnobIDList     id_list_fft;  // FFT generation and SNR (fast refresh)
+    GNURadio::KnobIDList     id_list_spec; // FFT data, fetched when changed
     GNURadio::KnobIDList     id_list_read; // FIXME
     GNURadio::KnobIDList     id_list_filt; // Filter parameters
     GNURadio::KnobIDList     id_list_ctl;  // Various control parameters
     GNURadio::KnobIDList     id_list_rf;   // RF control parameters
+    GNURadio::KnobIDList     id_list_rate; // FFT rate
+    GNURadio::KnobIDList     id_list_zoom; // FFT zoom
 
     QTime  *statTimer;  /*!< Delay timer used when fetching statistics. */
     QTimer *dataTimer;  /*!< Timer used to fetch data from remote receiver. */
     int     cb_counter; /*!< Callback counter. */
+    long    fft_gen;    /*!< Generation of the FFT data shown. */
+    int     fft_zoom;   /*!< FFT zoom factor shown. */
 
     CStatisticsClient *stats;
 
@@ -69,6 +74,7 @@ private slots:
     void on_chanButton_clicked(void);
     void on_gainSpin_valueChanged(int gain);
     void on_fftCombo_currentIndexChanged(int index);
+    void on_zoomCombo_currentIndexChanged(int index);
 };
 
 #endif // MAINWINDOW_H
@@ -0,0 +1,247 @@
+/* -*- c++ -*- */
+/*
+ * Copyright (c) 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Strx; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+// Standard includes
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Boost includes
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
+#include "batch.h"
+#include "correlator.h"
+#include "strx_file_source_c.h"
+
+
+/*! Order packets by time. */
+static bool packet_before(const decoded_packet &a, const decoded_packet &b)
+{
+    return a.time < b.time;
+}
+
+/*! \brief Merge the packets of all segments.
+ *  \param packets The packets of all segments, sorted by time on return.
+ *  \returns The number of duplicates removed.
+ *
+ * A packet in the overlap of two segments is normally decoded by both. The
+ * copies have the same contents and, as the time stamps are taken from the
+ * replay position, nearly the same time, so a packet is dropped if another
+ * segment delivered an identical packet within BATCH_DEDUP before it.
+ * Repeated packets within one segment are kept, they were sent twice.
+ */
+static size_t merge_packets(std::vector<decoded_packet> &packets)
+{
+    std::vector<decoded_packet> merged;
+    size_t i, j;
+    bool dup;
+
+    std::stable_sort(packets.begin(), packets.end(), packet_before);
+
+    merged.reserve(packets.size());
+    for (i = 0; i < packets.size(); i++)
+    {
+        const decoded_packet &p = packets[i];
+
+        dup = false;
+        for (j = merged.size(); j > 0 && merged[j-1].time >= p.time - BATCH_DEDUP; j--)
+        {
+            const decoded_packet &q = merged[j-1];
+
+            if (q.segment != p.segment && q.channel == p.channel && q.data == p.data)
+            {
+                dup = true;
+                break;
+            }
+        }
+
+        if (!dup)
+            merged.push_back(p);
+    }
+
+    i = packets.size() - merged.size();
+    packets.swap(merged);
+
+    return i;
+}
+
+/*! \brief Write a packet in the format of the correlator packet log.
+ *  \param fp The output file.
+ *  \param p The packet.
+ *  \param t0_ns UTC time of the first sample of the recording in ns, 0 if unknown.
+ *
+ * The time is UTC if the recording has an index, otherwise it is the time
+ * since the beginning of the recording.
+ */
+static void write_packet(FILE *fp, const decoded_packet &p, int64_t t0_ns)
+{
+    unsigned int len = p.data.size();
+    unsigned int x;
+
+    if (t0_ns)
+    {
+        int64_t ns = t0_ns + (int64_t)(p.time * 1.e9);
+        time_t secs = (time_t)(ns / 1000000000);
+        struct tm tstruct;
+        char t[40];
+
+        gmtime_r(&secs, &tstruct);
+        strftime(t, sizeof(t), "%F %T", &tstruct);
+        fprintf(fp, "%s.%03d ", t, (int)(ns % 1000000000 / 1000000));
+    }
+    else
+    {
+        fprintf(fp, "T+%.3f ", p.time);
+    }
+
+    fprintf(fp, "CH: %d  flag err: %1u  trellis err: %2u  ", p.channel, p.flag_err, p.trellis_err);
+    fprintf(fp, "Len: %3d  Len2: %3d  CRC: %04X %s  ID: %3u", p.data[0], p.data[1] ^ 0xFF,
+            (p.data[len - 2] << 8) | p.data[len - 1], p.crc_ok ? "OK " : "BAD", p.data[2]);
+    fprintf(fp, "  Packet:");
+    for (x = 0; x < len; x++)
+        fprintf(fp, " %02X", p.data[x]);
+    fprintf(fp, "\n");
+}
+
+/*! \brief Decode an I/Q file as fast as possible.
+ *  \param input The I/Q file, "file:/path/to/file".
+ *  \param quad_rate The sample rate of the file.
+ *  \param output The packet log file, stdout if empty.
+ *  \param jobs The number of segments processed in parallel, 0 for one per CPU core.
+ *  \param start The beginning of the part of the file to decode (s).
+ *  \param stop The end of the part of the file to decode (s), 0 for the end of the file.
+ *  \param factory Creates the receivers.
+ *  \returns 0 on success, 1 on error.
+ *
+ * The part of the file is split into segments, each replayed unthrottled
+ * through its own receiver running the full receive and decode chain,
+ * with all receivers running in parallel. The segments overlap by
+ * BATCH_OVERLAP, so every packet is complete in at least one segment; the
+ * packets are then merged, the duplicates from the overlaps removed, and
+ * written sorted by time in the format of the correlator packet log.
+ */
+int batch_decode(const std::string &input, double quad_rate, const std::string &output,
+                 int jobs, double start, double stop, receiver_factory factory)
+{
+    std::vector<receiver *> rx;
+    std::vector<decoded_packet> packets;
+    boost::thread_group threads;
+    boost::posix_time::ptime t_start = boost::posix_time::microsec_clock::universal_time();
+    double length, seg_len, seconds;
+    int64_t t0_ns;
+    size_t dups, good = 0;
+    int nseg, i;
+    FILE *fp;
+
+    if (input.compare(0, 5, "file:") != 0)
+    {
+        std::cerr << "Batch mode needs an I/Q file as input" << std::endl;
+        return 1;
+    }
+
+    // the duration and the start time, as seen through the index of the recording
+    {
+        strx::file_source_c::sptr file = strx::file_source_c::make(input.substr(5), quad_rate, false);
+
+        length = file->sample_to_time(file->nitems_total());
+        t0_ns = file->start_time_ns();
+    }
+    if (stop <= 0.0 || stop > length)
+        stop = length;
+    start = std::max(start, 0.0);
+    if (start >= stop)
+    {
+        std::cerr << "Nothing to decode between " << start << " s and " << stop << " s" << std::endl;
+        return 1;
+    }
+
+    if (jobs <= 0)
+        jobs = std::max(1u, boost::thread::hardware_concurrency());
+    nseg = std::max(1, std::min(jobs, (int)((stop - start) / BATCH_MIN_SEGMENT)));
+    seg_len = (stop - start) / nseg;
+
+    fp = output.empty() ? stdout : fopen(output.c_str(), "w");
+    if (fp == NULL)
+    {
+        std::cerr << "Can't create " << output << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    // the correlators would print every packet of every segment in random order
+    set_packet_log(0);
+
+    std::cerr << "Decoding " << stop - start << " s of " << input.substr(5) << " in "
+              << nseg << " segments" << std::endl;
+
+    for (i = 0; i < nseg; i++)
+    {
+        double seg_start = start + i * seg_len;
+        double seg_stop = (i == nseg - 1) ? stop : seg_start + seg_len;
+
+        rx.push_back(factory(i));
+        rx[i]->set_replay_speed(0.0);
+        rx[i]->set_replay_region(std::max(start, seg_start - BATCH_OVERLAP), seg_stop, false);
+    }
+
+    // receiver::start() runs the flow graph until the end of the segment
+    for (i = 0; i < nseg; i++)
+        threads.create_thread(boost::bind(&receiver::start, rx[i]));
+    threads.join_all();
+
+    for (i = 0; i < nseg; i++)
+    {
+        std::vector<decoded_packet> seg = rx[i]->take_packets();
+
+        for (size_t j = 0; j < seg.size(); j++)
+        {
+            seg[j].segment = i;
+            packets.push_back(seg[j]);
+        }
+        delete rx[i];
+    }
+
+    dups = merge_packets(packets);
+    for (size_t j = 0; j < packets.size(); j++)
+    {
+        write_packet(fp, packets[j], t0_ns);
+        if (packets[j].crc_ok)
+            good++;
+    }
+
+    if (fp != stdout && fclose(fp) != 0)
+    {
+        std::cerr << "Error writing " << output << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    seconds = (boost::posix_time::microsec_clock::universal_time() - t_start).total_milliseconds() / 1000.0;
+    std::cerr << packets.size() << " packets (" << good << " good), " << dups
+              << " duplicates removed, " << seconds << " s ("
+              << (stop - start) / std::max(seconds, 1.e-3) << "x real time)" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+/* -*- c++ -*- */
+/*
+ * Copyright (c) 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Strx; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <boost/function.hpp>
+
+#include "receiver.h"
+
+/*! Segments shorter than this are not worth a receiver of their own (s). */
+#define BATCH_MIN_SEGMENT  30.0
+
+/*! Each segment starts this much before its share of the file, so that the
+ *  demodulator has settled and packets across the boundary are complete (s). */
+#define BATCH_OVERLAP       2.0
+
+/*! Identical packets from different segments this close in time are the same packet (s). */
+#define BATCH_DEDUP         0.5
+
+/*! \brief Create a receiver for a batch segment.
+ *
+ * The receiver must be created in batch mode and be configured like a
+ * live receiver, except for the replay settings, which the batch decoder
+ * sets itself. The argument is the number of the segment, for naming.
+ */
+typedef boost::function<receiver *(int segment)> receiver_factory;
+
+int batch_decode(const std::string &input, double quad_rate, const std::string &output,
+                 int jobs, double start, double stop, receiver_factory factory);
+
+#endif // BATCH_H
@@ -20,14 +20,24 @@
  */
 
 // Standard includes
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
 #include <time.h>
+#include <algorithm>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 
 // Boost includes
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
-#include <boost/thread/shared_mutex.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef GR_CTRLPORT
 #include <rpcregisterhelpers.h>
@@ -37,38 +47,69 @@
 
 #define FFT_SIZE     4000
 #define AUDIO_RATE  96000
+#define CH_SPACING  1.0e6   /* Channelizer spacing in multi-channel mode. */
+
+#define AFC_RANGE   100.0e3 /* Max AFC correction from the nominal channel offset (Hz). */
+#define AFC_SEARCH  100.0e3 /* Carrier search range around the current channel offset (Hz). */
+#define AFC_HYST      5.0e3 /* Carrier offset error that triggers retuning (Hz). */
+#define AFC_MIN_SNR  10.0   /* Min carrier level above the noise floor (dB). */
+#define AFC_LOBE     10.0   /* Bins within this of the peak belong to the carrier (dB). */
+#define AFC_ALPHA     0.2   /* Carrier offset smoothing. */
+#define AFC_HOLDOFF   3     /* FFT frames to ignore after retuning. */
+
+#define TRIG_SNR_DROP  6.0  /* SNR drop below its slow average that triggers a recording (dB). */
+#define TRIG_SNR_MIN   6.0  /* Min slow average SNR for the SNR trigger to be armed (dB). */
+#define TRIG_SNR_ALPHA 0.01 /* Slow SNR average coefficient per FFT frame. */
+#define TRIG_ERRORS    5    /* Decoding errors within a second that trigger a recording. */
 
-static long fft_delay_msec = 25;
+#define IQREC_INDEX_PERIOD 1000 /* Time between I/Q recording index records (ms). */
 
 /*! \brief FFT thread function.
  *  \param rx The active instance of the receiver object.
  *
- * The FFT thread function rund periodically and performs the following
- * tasks:
+ * The FFT thread function wakes up whenever the FFT block has new data, but
+ * no more often than the FFT rate of the receiver, and performs the
+ * following tasks:
  *   - Get new FFT data and scale the FFT properly
+ *   - Track the carriers if AFC is enabled
  *   - Calculate SNR for both receiver channels
  *   - Send SNR for the active channel to the audio indicator.
+ *   - Start and stop I/Q recordings on triggers.
+ *   - Write the index of the I/Q recording.
+ * While no samples flow, e.g. when the receiver is stopped, the thread
+ * just sleeps in wait_fft().
  */
 static void fft_thread_func(receiver *rx)
 {
-    for(;;)
-    {
-        rx->process_fft();
-        rx->process_snr();
+    boost::posix_time::ptime next = boost::posix_time::microsec_clock::universal_time();
+    boost::posix_time::ptime now;
 
-        try
-        {
-            // Sleep and check for interrupt.
-            // To check for interrupt without sleep, use boost::this_thread::interruption_point()
-            // which also throws boost::thread_interrupted
-            boost::this_thread::sleep(boost::posix_time::milliseconds(fft_delay_msec));
-        }
-        catch(boost::thread_interrupted&)
+    try
+    {
+        for(;;)
         {
-            std::cout << "FFT thread is stopped" << std::endl;
-            return;
+            // Rate limit, then wait for data. Both are interruption points.
+            boost::this_thread::sleep(next);
+            while (!rx->wait_fft(250))
+                ;
+
+            rx->process_fft();
+            rx->process_afc();
+            rx->process_snr();
+            rx->process_trigger();
+            rx->process_iqrec_index();
+
+            // schedule the next update without accumulating lag
+            next += boost::posix_time::milliseconds(1000 / rx->get_fft_rate());
+            now = boost::posix_time::microsec_clock::universal_time();
+            if (next < now)
+                next = now;
         }
     }
+    catch(boost::thread_interrupted&)
+    {
+        std::cout << "FFT thread is stopped" << std::endl;
+    }
 }
 
 /*! Get current date/time, format is YYYYMMDD-HHMMSS */
@@ -84,20 +125,51 @@ const char* currentDateTime() {
     return buf;
 }
 
+/*! Get output file name for a channel in multi-channel mode.
+ *  \param output The output file name given by the user. "%d" is replaced by
+ *                the channel number, or the channel number is appended if the
+ *                name does not contain "%d".
+ *  \param channel The channel number.
+ */
+static std::string channel_output(const std::string output, int channel)
+{
+    std::string name = output.empty() ? "strx_ch%d.f32" : output;
+    std::ostringstream ch;
+    size_t pos;
+
+    ch << channel;
+    pos = name.find("%d");
+    if (pos == std::string::npos)
+        return name + "." + ch.str();
+
+    return name.replace(pos, 2, ch.str());
+}
+
 /*! \brief Public contructor.
  *  \param name The receiver name. Used for ctrlport names.
  *  \param input Input device specifier (see below).
  *  \param output Output file name. Using stdout if empty.
  *  \param quad_rate Quadrature rate in samples per second.
+ *  \param multi_channel Demodulate all channels in parallel, each to its own output.
+ *  \param decode Decode the packets in-process instead of writing the soft
+ *                symbols to the output.
+ *  \param batch Decode the packets in-process and collect them for
+ *               take_packets() instead of delivering them to the TCP ports.
  * 
  * The input can be a complex I/Q file or a USRP device. I/Q file is selected if the device string
  * is of the form "file:/some/path", otherwise UHD is assumed with subdev in the string.
+ *
+ * In multi-channel mode the channels are split by a polyphase channelizer
+ * and each channel has its own demodulator chain and output file, see
+ * channel_output() for the naming.
  * 
  * \todo Use gr-osmosdr as soon as it support gnuradio 3.7
  */
 receiver::receiver(const std::string name, const std::string input, const std::string output,
-                   const std::string audio_out, double quad_rate)
+                   const std::string audio_out, double quad_rate, bool multi_channel,
+                   bool decode, bool batch)
 {
+    int i, nchains;
 
     if (name.empty())
         d_name = "strx";
@@ -114,18 +186,61 @@ receiver::receiver(const std::string name, const std::string input, const std::s
 
     src = strx::source_c::make(input, d_quad_rate);
     fft = strx::fft_c::make(FFT_SIZE);
-    iqrec = gr::blocks::file_sink::make(sizeof(gr_complex), "/tmp/strx.raw");
-    iqrec->set_unbuffered(true);
-    iqrec->close();
+    // an unthrottled batch segment has no use for a spectrum of every
+    // sample unless the AFC follows it, see set_afc()
+    fft->set_averaging(!batch);
+    iqrec = strx::iq_recorder_c::make(d_quad_rate);
     d_recording = 0;
+    d_iqrec_format = strx::IQ_FORMAT_FC32;
+    d_iqrec_idx = NULL;
+    d_iqrec_idx_drops = 0;
+    d_trig = 0;
+    d_trig_active = false;
+    d_trig_post = 10.0;
+    d_trig_snr_ref = 0.0;
+    d_trig_errors = 0;
+    d_trig_check = boost::get_system_time();
 
     // channel filter setup
     d_ch_offs[0] = -1.0e6;
     d_ch_offs[1] = 1.0e6;
     d_ch = 0;
+    for (i = 0; i <= MAX_CHAN; i++)
+    {
+        d_afc_nominal[i] = d_ch_offs[i];
+        d_afc_valid[i] = false;
+    }
+    d_afc = false;
+    d_afc_holdoff = 0;
     d_cutoff = 400e3;
+    d_multi = multi_channel;
+    d_batch = batch;
+    d_decode = decode || batch;
+    nchains = d_multi ? MAX_CHAN+1 : 1;
     taps = gr::filter::firdes::low_pass(1.0, d_quad_rate, d_cutoff, d_cutoff);
-    filter = gr::filter::freq_xlating_fir_filter_ccf::make(2, taps, d_ch_offs[d_ch], d_quad_rate);
+    if (d_multi)
+    {
+        // The channelizer outputs are CH_SPACING apart and oversampled to the
+        // same 2 Msps as the single channel filter. Whatever offset is left
+        // between a channel and its channelizer output is removed by a tuner
+        // with a single tap, i.e. a plain rotator.
+        d_nfilts = (int)(d_quad_rate / CH_SPACING);
+        ch_s2ss = gr::blocks::stream_to_streams::make(sizeof(gr_complex), d_nfilts);
+        channelizer = gr::filter::pfb_channelizer_ccf::make(d_nfilts, taps, d_nfilts / 2.f);
+        ch_null = gr::blocks::null_sink::make(sizeof(gr_complex));
+        for (i = 0; i < nchains; i++)
+        {
+            d_ch_out[i] = channelizer_output(i);
+            tuner[i] = gr::filter::freq_xlating_fir_filter_ccf::make(1, std::vector<float>(1, 1.0f),
+                            0.0, d_quad_rate / 2.0);
+            tune_channel(i);
+        }
+    }
+    else
+    {
+        d_nfilts = 0;
+        filter = gr::filter::freq_xlating_fir_filter_ccf::make(2, taps, d_ch_offs[d_ch], d_quad_rate);
+    }
 
     // audio SSI
     if (audio_out == "none")
@@ -140,30 +255,57 @@ receiver::receiver(const std::string name, const std::string input, const std::s
     }
 
     // other blocks
-    demod = gr::analog::quadrature_demod_cf::make(1.f);
-    iir = gr::filter::single_pole_iir_filter_ff::make(1.e-3);
-    sub = gr::blocks::sub_ff::make();
-    clock_recov = gr::digital::clock_recovery_mm_ff::make(8.f, 10.e-3f, 10.e-3f, 1.e-3f, 10.e-3f);
+    for (i = 0; i < nchains; i++)
+    {
+        demod[i] = gr::analog::quadrature_demod_cf::make(1.f);
+        iir[i] = gr::filter::single_pole_iir_filter_ff::make(1.e-3);
+        sub[i] = gr::blocks::sub_ff::make();
+        clock_recov[i] = gr::digital::clock_recovery_mm_ff::make(8.f, 10.e-3f, 10.e-3f, 1.e-3f, 10.e-3f);
+    }
 
 
-    if (output.empty())
+    if (d_batch)
+    {
+        for (i = 0; i < nchains; i++)
+            decoder[i] = strx::decoder_f::make(i, boost::bind(&receiver::collect_packet, this, _1));
+    }
+    else if (d_decode)
+    {
+        for (i = 0; i < nchains; i++)
+            decoder[i] = strx::decoder_f::make(i);
+    }
+    else if (d_multi)
+    {
+        for (i = 0; i < nchains; i++)
+            fifo[i] = gr::blocks::file_sink::make(sizeof(float), channel_output(output, i).c_str());
+    }
+    else if (output.empty())
     {
-        fifo = gr::blocks::file_sink::make(sizeof(float), "/dev/fd/1");
+        fifo[0] = gr::blocks::file_sink::make(sizeof(float), "/dev/fd/1");
     }
     else
     {
-        fifo = gr::blocks::file_sink::make(sizeof(float), output.c_str());
+        fifo[0] = gr::blocks::file_sink::make(sizeof(float), output.c_str());
     }
 
     // Initialize FFT
-    fft_thread = boost::thread(&fft_thread_func, this);
+    d_fft_rate = 40;
+    d_fft_zoom = 1;
+    d_fft_round = false;
     d_fftAvg = 0.5f;
     d_fftLen = 0;
-    d_fftData = new std::complex<float>[MAX_FFT_SIZE];
+    d_psdData = new float[MAX_FFT_SIZE];
     d_realFftData = new float[MAX_FFT_SIZE];
     d_iirFftData = new float[MAX_FFT_SIZE];
     for (int i = 0; i < MAX_FFT_SIZE; i++)
         d_iirFftData[i] = -120.0f;  // dBFS
+    for (int i = 0; i < FFT_SNAPSHOTS; i++)
+    {
+        d_snapData[i] = new float[MAX_FFT_SIZE];
+        d_snapLen[i] = 0;
+    }
+    d_fft_writing = 0;
+    d_fft_gen = 0;
 
     // initialize SNR
     d_signal = -120.0;
@@ -172,6 +314,9 @@ receiver::receiver(const std::string name, const std::string input, const std::s
     d_snr_alpha_inv = 1.0 - d_snr_alpha;
     d_last_snr = 0.0;
 
+    // start FFT processing once the buffers are in place
+    fft_thread = boost::thread(&fft_thread_func, this);
+
     // initialize control port
 #ifdef GR_CTRLPORT
     add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, double>
@@ -205,6 +350,20 @@ receiver::receiver(const std::string name, const std::string input, const std::s
             )
     ));
 
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, long>
+            (
+                d_name,   // const std::string& name,
+                "fftgen",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::get_fft_generation, // Tfrom (T::*function)(),
+                pmt::mp(0L), pmt::mp(0x7fffffffL), pmt::mp(0L),
+                "", // const char* units_ = "",
+                "FFT generation", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+
     // SNR
     add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, double>
             (
@@ -306,6 +465,150 @@ receiver::receiver(const std::string name, const std::string input, const std::s
             )
     ));
 
+    // FFT rate
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, long>
+            (
+                d_name,   // const std::string& name,
+                "fftrate",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::get_fft_rate, // Tfrom (T::*function)(),
+                pmt::mp(1L), pmt::mp(1000L), pmt::mp(40L),
+                "Hz", // const char* units_ = "",
+                "FFT rate", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_set<receiver, long>
+            (
+                d_name,   // const std::string& name,
+                "fftrate",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::set_fft_rate, // Tfrom (T::*function)(),
+                pmt::mp(1L), pmt::mp(1000L), pmt::mp(40L),
+                "Hz", // const char* units_ = "",
+                "FFT rate", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+
+    // FFT size
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, int>
+            (
+                d_name,   // const std::string& name,
+                "fftsize",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::get_fft_size, // Tfrom (T::*function)(),
+                pmt::mp(2), pmt::mp(MAX_FFT_SIZE), pmt::mp(FFT_SIZE),
+                "", // const char* units_ = "",
+                "FFT size", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_set<receiver, int>
+            (
+                d_name,   // const std::string& name,
+                "fftsize",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::set_fft_size, // Tfrom (T::*function)(),
+                pmt::mp(2), pmt::mp(MAX_FFT_SIZE), pmt::mp(FFT_SIZE),
+                "", // const char* units_ = "",
+                "FFT size", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+
+    // FFT window
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, int>
+            (
+                d_name,   // const std::string& name,
+                "fftwindow",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::get_fft_window, // Tfrom (T::*function)(),
+                pmt::mp((int)filter::firdes::WIN_HAMMING),
+                pmt::mp((int)filter::firdes::WIN_BLACKMAN_hARRIS),
+                pmt::mp((int)filter::firdes::WIN_HAMMING),
+                "", // const char* units_ = "",
+                "FFT window (0=Hamming, 1=Hann, 2=Blackman, 3=Rectangular, 4=Kaiser, 5=Blackman-Harris)", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_set<receiver, int>
+            (
+                d_name,   // const std::string& name,
+                "fftwindow",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::set_fft_window, // Tfrom (T::*function)(),
+                pmt::mp((int)filter::firdes::WIN_HAMMING),
+                pmt::mp((int)filter::firdes::WIN_BLACKMAN_hARRIS),
+                pmt::mp((int)filter::firdes::WIN_HAMMING),
+                "", // const char* units_ = "",
+                "FFT window (0=Hamming, 1=Hann, 2=Blackman, 3=Rectangular, 4=Kaiser, 5=Blackman-Harris)", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+
+    // FFT zoom
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, int>
+            (
+                d_name,   // const std::string& name,
+                "fftzoom",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::get_fft_zoom, // Tfrom (T::*function)(),
+                pmt::mp(1), pmt::mp(MAX_FFT_ZOOM), pmt::mp(1),
+                "", // const char* units_ = "",
+                "FFT zoom around the active channel", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_set<receiver, int>
+            (
+                d_name,   // const std::string& name,
+                "fftzoom",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::set_fft_zoom, // Tfrom (T::*function)(),
+                pmt::mp(1), pmt::mp(MAX_FFT_ZOOM), pmt::mp(1),
+                "", // const char* units_ = "",
+                "FFT zoom around the active channel", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+
+    // AFC
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, int>
+            (
+                d_name,   // const std::string& name,
+                "afc",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::get_afc, // Tfrom (T::*function)(),
+                pmt::mp(0), pmt::mp(1), pmt::mp(0),
+                "", // const char* units_ = "",
+                "Automatic frequency control", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_set<receiver, int>
+            (
+                d_name,   // const std::string& name,
+                "afc",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::set_afc, // Tfrom (T::*function)(),
+                pmt::mp(0), pmt::mp(1), pmt::mp(0),
+                "", // const char* units_ = "",
+                "Automatic frequency control", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+
     // I/Q recording
     add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, int>
             (
@@ -333,6 +636,45 @@ receiver::receiver(const std::string name, const std::string input, const std::s
                 DISPNULL
             )
     ));
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, long>
+            (
+                d_name,   // const std::string& name,
+                "iqdrops",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::iqrec_dropped, // Tfrom (T::*function)(),
+                pmt::mp(0L), pmt::mp(0x7fffffffL), pmt::mp(0L),
+                "samples", // const char* units_ = "",
+                "I/Q samples dropped by the recorder", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_get<receiver, int>
+            (
+                d_name,   // const std::string& name,
+                "iqtrig",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::get_iqrec_trigger, // Tfrom (T::*function)(),
+                pmt::mp(0), pmt::mp(IQREC_TRIG_SNR | IQREC_TRIG_ERRORS), pmt::mp(0),
+                "", // const char* units_ = "",
+                "I/Q recording triggers (1 = SNR drop, 2 = decoding errors)", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
+    add_rpc_variable(rpcbasic_sptr(new rpcbasic_register_set<receiver, int>
+            (
+                d_name,   // const std::string& name,
+                "iqtrig",  // const char* functionbase,
+                this,      // T* obj,
+                &receiver::set_iqrec_trigger, // Tfrom (T::*function)(),
+                pmt::mp(0), pmt::mp(IQREC_TRIG_SNR | IQREC_TRIG_ERRORS), pmt::mp(0),
+                "", // const char* units_ = "",
+                "I/Q recording triggers (1 = SNR drop, 2 = decoding errors)", // const char* desc_ = "",
+                RPC_PRIVLVL_MIN,
+                DISPNULL
+            )
+    ));
 
 #endif
 
@@ -346,9 +688,17 @@ receiver::~receiver()
     fft_thread.join();
     tb->stop();
 
-    delete [] d_fftData;
+    {
+        boost::mutex::scoped_lock lock(d_iqrec_mutex);
+        if (d_recording)
+            iqrec_start_stop(0);
+    }
+
+    delete [] d_psdData;
     delete [] d_realFftData;
     delete [] d_iirFftData;
+    for (int i = 0; i < FFT_SNAPSHOTS; i++)
+        delete [] d_snapData[i];
 }
 
 /*! \brief Start the receiver. */
@@ -378,12 +728,31 @@ void receiver::set_antenna(std::string antenna)
     src->set_antenna(antenna);
 }
 
+/*! Set I/Q file replay speed.
+ * \param speed The replay speed relative to real time, 0 for as fast as possible.
+ */
+void receiver::set_replay_speed(double speed)
+{
+    src->set_speed(speed);
+}
+
+/*! Set the part of the I/Q file to replay.
+ * \param start The beginning of the part in seconds.
+ * \param stop The end of the part in seconds, 0 for the end of the file.
+ * \param loop Whether to loop over the part or stop the receiver at its end.
+ */
+void receiver::set_replay_region(double start, double stop, bool loop)
+{
+    src->set_region(start, stop, loop);
+}
+
 /*! Set new RF frequency.
  * \param freq_hz The new frequency in Hz.
  */
 void receiver::set_rf_freq(double freq_hz)
 {
     src->set_freq(freq_hz);
+    iqrec->set_center_freq(rx_freq());
 }
 
 /*! Get current RF frequency.
@@ -444,8 +813,33 @@ void receiver::rf_gain_range(double *start, double *stop, double *step)
  */
 void receiver::set_filter_offset(double freq_hz)
 {
-    filter->set_center_freq(freq_hz);
-    d_ch_offs[d_ch] = freq_hz;
+    boost::mutex::scoped_lock lock(d_tune_mutex);
+
+    // AFC tracks around the new offset from now on
+    d_afc_nominal[d_ch] = freq_hz;
+    d_afc_valid[d_ch] = false;
+    retune_channel(d_ch, freq_hz);
+}
+
+/*! \brief Move a channel filter.
+ *  \param channel The channel.
+ *  \param freq_hz The new offset frequency in Hz.
+ *
+ * Called with d_tune_mutex held.
+ */
+void receiver::retune_channel(int channel, double freq_hz)
+{
+    d_ch_offs[channel] = freq_hz;
+    if (d_multi)
+        tune_channel(channel);
+    else if (channel == d_ch)
+        filter->set_center_freq(freq_hz);
+
+    if (channel == d_ch)
+        update_fft_zoom();
+
+    // FFT frames in the pipeline may predate the move
+    d_afc_holdoff = AFC_HOLDOFF;
 }
 
 /*! Get channel filter offset (aka. receiver LO).
@@ -453,6 +847,9 @@ void receiver::set_filter_offset(double freq_hz)
  */
 double receiver::get_filter_offset(void)
 {
+    if (d_multi)
+        return d_ch_offs[d_ch];
+
     return filter->center_freq();
 }
 
@@ -470,7 +867,10 @@ void receiver::set_filter_cutoff(double freq_hz)
 
     d_cutoff = freq_hz;
     taps = filter::firdes::low_pass(1.0, d_quad_rate, d_cutoff, d_cutoff);
-    filter->set_taps(taps);
+    if (d_multi)
+        channelizer->set_taps(taps);
+    else
+        filter->set_taps(taps);
 }
 
 /*! Get current filter cutoff (1/2 width) */
@@ -479,13 +879,22 @@ double receiver::get_filter_cutoff(void)
     return d_cutoff;
 }
 
-/*! Select new channel */
+/*! Select new channel
+ *
+ * In multi-channel mode all channels are demodulated anyway, so this only
+ * selects the channel used for SNR and filter offset control.
+ */
 void receiver::set_active_channel(int channel)
 {
+    boost::mutex::scoped_lock lock(d_tune_mutex);
+
     if (channel <= MAX_CHAN)
     {
         d_ch = channel;
-        filter->set_center_freq(d_ch_offs[d_ch]);
+        if (!d_multi)
+            filter->set_center_freq(d_ch_offs[d_ch]);
+        update_fft_zoom();
+        d_afc_holdoff = AFC_HOLDOFF;
     }
 }
 
@@ -499,36 +908,174 @@ int  receiver::get_active_channel(void)
 /*! Set FFT rate.
  *  \param rate The new FFT rate in Hz (updates per second).
  *
- * The FFT rate is the frequency by which the FFT thread is running.
+ * The FFT rate is the max frequency by which the FFT thread is running.
+ * Each receiver has its own rate.
  *
  * \sa fft_thread_func
  */
 void receiver::set_fft_rate(long rate)
 {
-    fft_delay_msec = 1000 / rate;
+    if (rate < 1)
+        rate = 1;
+    else if (rate > 1000)
+        rate = 1000;
+
+    d_fft_rate = rate;
+}
+
+/*! Get FFT rate. */
+long receiver::get_fft_rate(void)
+{
+    return d_fft_rate;
+}
+
+/*! Set FFT zoom.
+ *  \param zoom The zoom factor, 1 for the full band.
+ *
+ * In zoom mode the FFT covers only 1/zoom of the band around the active
+ * channel with zoom times finer resolution. The SNR is not updated while
+ * zoomed in, since the noise reference around 0 Hz is out of view.
+ */
+void receiver::set_fft_zoom(int zoom)
+{
+    if (zoom < 1)
+        zoom = 1;
+    else if (zoom > MAX_FFT_ZOOM)
+        zoom = MAX_FFT_ZOOM;
+
+    boost::mutex::scoped_lock lock(d_tune_mutex);
+
+    d_fft_zoom = zoom;
+    update_fft_zoom();
+    d_afc_holdoff = AFC_HOLDOFF;
+}
+
+/*! Get FFT zoom. */
+int receiver::get_fft_zoom(void)
+{
+    return d_fft_zoom;
+}
+
+/*! Set FFT size.
+ *  \param size The new FFT size.
+ *
+ * The FFT keeps running at the old size until the FFTW plan for the new size
+ * is ready, which is immediately if it has been prepared.
+ *
+ * \sa prepare_fft_sizes
+ */
+void receiver::set_fft_size(int size)
+{
+    if (d_fft_round)
+        size = strx::fft_c::fftw_size(size);
+
+    fft->set_fft_size(size);
+}
+
+/*! Get current FFT size. */
+int receiver::get_fft_size(void)
+{
+    return fft->get_fft_size();
+}
+
+/*! Round FFT sizes to sizes that FFTW handles well.
+ *  \param round Whether to round sizes passed to set_fft_size() and
+ *               prepare_fft_sizes() from now on.
+ */
+void receiver::set_fft_round(bool round)
+{
+    d_fft_round = round;
+}
+
+/*! Set FFT window type.
+ *  \param wintype The window type, see gnuradio/filter/firdes.h
+ */
+void receiver::set_fft_window(int wintype)
+{
+    fft->set_window_type(wintype);
+}
+
+/*! Get FFT window type. */
+int receiver::get_fft_window(void)
+{
+    return fft->get_window_type();
+}
+
+/*! Build FFT plans for later use in the background.
+ *  \param sizes The FFT sizes.
+ */
+void receiver::prepare_fft_sizes(const std::vector<int> &sizes)
+{
+    std::vector<int> prep(sizes);
+
+    if (d_fft_round)
+        for (unsigned int i = 0; i < prep.size(); i++)
+            prep[i] = strx::fft_c::fftw_size(prep[i]);
+
+    fft->prepare_fft_sizes(prep);
+}
+
+/*! Center the FFT zoom on the active channel. */
+void receiver::update_fft_zoom(void)
+{
+    fft->set_zoom(d_fft_zoom, d_ch_offs[d_ch] / d_quad_rate);
+}
+
+/*! Wait for new FFT data.
+ *  \param timeout_ms Max time to wait in milliseconds.
+ *  \return True if new FFT data is available.
+ */
+bool receiver::wait_fft(int timeout_ms)
+{
+    return fft->wait_psd_data(timeout_ms);
 }
 
 /*! Get latest FFT data.
  *  \return A vector of floats containing the latest FFT data (dBFS units).
  *
  * This function is used by the control port to fetch the latest FFT data.
- * The FFT data has already been prostprocessed and converted to dBFS, thus
- * all we need to do here is to copy the data to a vector.
+ * The FFT data has already been prostprocessed, converted to dBFS and
+ * published by the FFT thread, thus all we need to do here is to copy the
+ * latest snapshot directly into the returned vector. No lock is taken; the
+ * copy is retried if the FFT thread reused the slot while we were reading.
+ *
+ * \sa get_fft_generation
  */
 std::vector<float> receiver::get_fft_data(void)
 {
-    if (d_iirFftData != NULL && d_fftLen > 0)
-    {
-        fft_lock.lock();
-        std::vector<float> vec(d_iirFftData, d_iirFftData+d_fftLen);
-        fft_lock.unlock();
-        return vec;
-    }
-    else
+    std::vector<float> vec;
+    uint64_t gen;
+    int slot;
+    int tries;
+
+    for (tries = 0; tries < 3; tries++)
     {
-        std::vector<float> vec;
-        return vec;
+        gen = __atomic_load_n(&d_fft_gen, __ATOMIC_ACQUIRE);
+        if (gen == 0)
+            break;
+
+        slot = gen % FFT_SNAPSHOTS;
+        vec.assign(d_snapData[slot], d_snapData[slot] + std::min(d_snapLen[slot], MAX_FFT_SIZE));
+
+        // the slot is reused for generation gen + FFT_SNAPSHOTS
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&d_fft_writing, __ATOMIC_RELAXED) < gen + FFT_SNAPSHOTS)
+            return vec;
     }
+
+    vec.clear();
+    return vec;
+}
+
+/*! Get FFT generation.
+ *  \return The number of spectra published so far.
+ *
+ * Control port clients can poll this cheap value and only fetch the FFT data
+ * when it has changed.
+ */
+long receiver::get_fft_generation(void)
+{
+    return (long)__atomic_load_n(&d_fft_gen, __ATOMIC_ACQUIRE);
 }
 
 double receiver::get_snr(void)
@@ -536,18 +1083,81 @@ double receiver::get_snr(void)
     return d_last_snr;
 }
 
+/*! Get the channelizer output closest to a channel offset. */
+int receiver::channelizer_output(int channel)
+{
+    int k = (int)floor(d_ch_offs[channel] / CH_SPACING + 0.5);
+
+    return ((k % d_nfilts) + d_nfilts) % d_nfilts;
+}
+
+/*! \brief Tune a channel in multi-channel mode.
+ *  \param channel The channel to tune to d_ch_offs[channel].
+ *
+ * The fine tuner takes care of the offset within the channelizer output.
+ * Moving a channel to another channelizer output means reconnecting the
+ * flow graph, which happens only when the offset is changed by more than
+ * half the channel spacing.
+ */
+void receiver::tune_channel(int channel)
+{
+    int out = channelizer_output(channel);
+    double k = floor(d_ch_offs[channel] / CH_SPACING + 0.5);
+
+    tuner[channel]->set_center_freq(d_ch_offs[channel] - k * CH_SPACING);
+    if (out != d_ch_out[channel])
+    {
+        tb->lock();
+        tb->disconnect_all();
+        d_ch_out[channel] = out;
+        connect_all();
+        tb->unlock();
+    }
+}
+
 /*! Connect all blocks in the receiver chain. */
 void receiver::connect_all()
 {
-    tb->connect(src, 0, filter, 0);
+    int i, nchains = d_multi ? MAX_CHAN+1 : 1;
+
     tb->connect(src, 0, fft, 0);
     tb->connect(src, 0, iqrec, 0);
-    tb->connect(filter, 0, demod, 0);
-    tb->connect(demod, 0, iir, 0);
-    tb->connect(demod, 0, sub, 0);
-    tb->connect(iir, 0, sub, 1);
-    tb->connect(sub, 0, clock_recov, 0);
-    tb->connect(clock_recov, 0, fifo, 0);
+
+    if (d_multi)
+    {
+        int nulls = 0;
+
+        tb->connect(src, 0, ch_s2ss, 0);
+        for (i = 0; i < d_nfilts; i++)
+            tb->connect(ch_s2ss, i, channelizer, i);
+        for (i = 0; i < nchains; i++)
+            tb->connect(channelizer, d_ch_out[i], tuner[i], 0);
+
+        // unused channelizer outputs must be connected too
+        for (i = 0; i < d_nfilts; i++)
+            if (std::find(d_ch_out, d_ch_out + nchains, i) == d_ch_out + nchains)
+                tb->connect(channelizer, i, ch_null, nulls++);
+
+        for (i = 0; i < nchains; i++)
+            tb->connect(tuner[i], 0, demod[i], 0);
+    }
+    else
+    {
+        tb->connect(src, 0, filter, 0);
+        tb->connect(filter, 0, demod[0], 0);
+    }
+
+    for (i = 0; i < nchains; i++)
+    {
+        tb->connect(demod[i], 0, iir[i], 0);
+        tb->connect(demod[i], 0, sub[i], 0);
+        tb->connect(iir[i], 0, sub[i], 1);
+        tb->connect(sub[i], 0, clock_recov[i], 0);
+        if (d_decode)
+            tb->connect(clock_recov[i], 0, decoder[i], 0);
+        else
+            tb->connect(clock_recov[i], 0, fifo[i], 0);
+    }
 
     if (d_use_audio)
     {
@@ -555,13 +1165,89 @@ void receiver::connect_all()
     }
 }
 
+/* log2(1+t) for t in 0..1, least squares fit, max error 1.4e-5 */
+#define LOG2_C0  1.43909303e-05f
+#define LOG2_C1  1.44159208f
+#define LOG2_C2 -0.707253433f
+#define LOG2_C3  0.411561482f
+#define LOG2_C4 -0.189832446f
+#define LOG2_C5  0.0439286277f
+
+#define DB_PER_LOG2 3.01029996f /* 10*log10(2) */
+
+/*! \brief Convert FFT power to dBFS and run the video filter.
+ *  \param pwr The FFT power.
+ *  \param db Output, the power in dBFS.
+ *  \param iir The video filter state, updated in place.
+ *  \param n The number of bins.
+ *  \param avg The video filter parameter.
+ *
+ * The logarithm is computed from the float exponent and a polynomial in
+ * the mantissa, good to 0.0001 dB, four bins at a time with SSE2.
+ */
+static void power_to_db(const float *pwr, float *db, float *iir, int n, float avg)
+{
+    const float slope = avg / 150.0f;
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i mant_mask = _mm_set1_epi32(0x007FFFFF);
+    const __m128i one_bits = _mm_set1_epi32(0x3F800000);
+    const __m128i bias = _mm_set1_epi32(127);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i bits = _mm_castps_si128(_mm_add_ps(_mm_loadu_ps(pwr + i), _mm_set1_ps(1.0e-20f)));
+        __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), bias));
+        __m128 t = _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, mant_mask), one_bits)), _mm_set1_ps(1.0f));
+        __m128 p = _mm_set1_ps(LOG2_C5);
+
+        p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(LOG2_C4));
+        p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(LOG2_C3));
+        p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(LOG2_C2));
+        p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(LOG2_C1));
+        p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(LOG2_C0));
+
+        __m128 d = _mm_mul_ps(_mm_add_ps(e, p), _mm_set1_ps(DB_PER_LOG2));
+        _mm_storeu_ps(db + i, d);
+
+        // iir += gain * (db - iir), gain = avg * (150 + db) / 150
+        __m128 gain = _mm_add_ps(_mm_set1_ps(avg), _mm_mul_ps(_mm_set1_ps(slope), d));
+        __m128 y = _mm_loadu_ps(iir + i);
+        _mm_storeu_ps(iir + i, _mm_add_ps(y, _mm_mul_ps(gain, _mm_sub_ps(d, y))));
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        float x = pwr[i] + 1.0e-20f;
+        uint32_t bits;
+        float t;
+
+        memcpy(&bits, &x, sizeof(bits));
+        int e = (int)(bits >> 23) - 127;
+        bits = (bits & 0x007FFFFF) | 0x3F800000;
+        memcpy(&t, &bits, sizeof(t));
+        t -= 1.0f;
+
+        float p = ((((LOG2_C5 * t + LOG2_C4) * t + LOG2_C3) * t + LOG2_C2) * t + LOG2_C1) * t + LOG2_C0;
+        float d = ((float)e + p) * DB_PER_LOG2;
+
+        db[i] = d;
+        iir[i] += (avg + slope * d) * (d - iir[i]);
+    }
+}
+
 /*! \brief Process FFT data.
  *
  * Perform FFT data processing consisting of the following steps:
- * - Fetch the latest FFT data
- * - Scale it according to FFT size
+ * - Fetch the power spectrum averaged over all samples since the last call
+ * - Shift it to put 0 Hz in the middle
  * - Convert to dBFS
  * - Calculate the average if averaging is enabled
+ * - Publish the result for get_fft_data() and bump the FFT generation
+ * The shift is done as two contiguous runs through the vectorized
+ * power_to_db(), so there is no per-bin branching.
  * The processing is performed at each cycle even though we could postpone the
  * conversion to dBFS and averaging to only happen when someone asks for it. I
  * expect though that this extra processing will reduce the control port latency
@@ -569,59 +1255,182 @@ void receiver::connect_all()
  */
 void receiver::process_fft(void)
 {
-    int i;
-    float gain;
-    float pwr;
-    std::complex<float> pt;             /* a single FFT point used in calculations */
-    std::complex<float> scaleFactor;    /* normalizing factor (fftsize cast to complex) */
+    int half;
+
+    uint64_t gen;
+    int slot;
 
-    fft->get_fft_data(d_fftData, d_fftLen);
+    fft->get_psd_data(d_psdData, d_fftLen);
     if (d_fftLen == 0)
         return;
 
-    fft_lock.lock();
-    scaleFactor = std::complex<float>((float)d_fftLen);
+    // Shift the FFT, putting 0 Hz in the middle
+    half = d_fftLen / 2;
+    power_to_db(d_psdData + half, d_realFftData, d_iirFftData, half, d_fftAvg);
+    power_to_db(d_psdData, d_realFftData + half, d_iirFftData + half, d_fftLen - half, d_fftAvg);
+
+    // publish the averaged spectrum in the oldest slot
+    gen = d_fft_gen + 1;    // only written by this thread
+    slot = gen % FFT_SNAPSHOTS;
+    __atomic_store_n(&d_fft_writing, gen, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(d_snapData[slot], d_iirFftData, sizeof(float) * d_fftLen);
+    d_snapLen[slot] = d_fftLen;
+    __atomic_store_n(&d_fft_gen, gen, __ATOMIC_RELEASE);
+}
+
+/*! \brief Automatic frequency control.
+ *
+ * Finds the carrier near the current offset of each demodulated channel in
+ * the latest FFT and retunes the channel when the smoothed carrier offset is
+ * more than AFC_HYST away from the current offset. The correction is limited
+ * to AFC_RANGE from the nominal offset set by the operator. The hysteresis
+ * leaves small errors to the DC removal after the demodulator and keeps the
+ * filter from jittering. In single channel mode only the active channel is
+ * tracked. In zoom mode the finer resolution of the zoomed FFT is used.
+ */
+void receiver::process_afc(void)
+{
+    boost::mutex::scoped_lock lock(d_tune_mutex);
+    double rbw, center, freq;
+    int ch;
+
+    if (!d_afc || d_fftLen <= 0)
+        return;
+
+    if (d_afc_holdoff > 0)
+    {
+        d_afc_holdoff--;
+        return;
+    }
+
+    rbw = d_quad_rate / d_fft_zoom / d_fftLen;
+    center = (d_fft_zoom > 1) ? d_ch_offs[d_ch] : 0.0;
 
-    // Normalize, calculcate power and shift the FFT
-    for (i = 0; i < d_fftLen; i++)
+    for (ch = 0; ch <= MAX_CHAN; ch++)
     {
-        // normalize and shift
-        if (i < d_fftLen/2)
+        if (!d_multi && ch != d_ch)
+            continue;
+
+        if (!find_carrier(d_ch_offs[ch], center, rbw, &freq))
         {
-            pt = d_fftData[d_fftLen/2+i] / scaleFactor;
+            d_afc_valid[ch] = false;
+            continue;
+        }
+
+        freq = std::max(freq, d_afc_nominal[ch] - AFC_RANGE);
+        freq = std::min(freq, d_afc_nominal[ch] + AFC_RANGE);
+
+        if (d_afc_valid[ch])
+        {
+            d_afc_est[ch] += AFC_ALPHA * (freq - d_afc_est[ch]);
         }
         else
         {
-            pt = d_fftData[i-d_fftLen/2] / scaleFactor;
+            d_afc_est[ch] = freq;
+            d_afc_valid[ch] = true;
         }
-        pwr = pt.imag()*pt.imag() + pt.real()*pt.real();
-
-        /* calculate power in dBFS */
-        d_realFftData[i] = 10.0 * log10(pwr + 1.0e-20);
 
-        /* FFT averaging (aka. video filter) */
-        gain = d_fftAvg * (150.0+d_realFftData[i])/150.0;
+        if (fabs(d_afc_est[ch] - d_ch_offs[ch]) > AFC_HYST)
+        {
+            std::cerr << "AFC: channel " << ch << " retuned to "
+                      << d_afc_est[ch] << " Hz" << std::endl;
+            retune_channel(ch, d_afc_est[ch]);
+        }
+    }
+}
 
-        d_iirFftData[i] = (1.0 - gain) * d_iirFftData[i] + gain * d_realFftData[i];
+/*! \brief Find a carrier in the latest FFT.
+ *  \param offset The channel offset to search around in Hz.
+ *  \param center The offset of the FFT center in Hz.
+ *  \param rbw The FFT resolution bandwidth in Hz.
+ *  \param freq Returns the carrier offset in Hz.
+ *  \return True if a carrier was found within AFC_SEARCH of offset.
+ *
+ * The carrier offset is the power weighted centroid of all bins within
+ * AFC_LOBE of the strongest one, which covers both tones of the GFSK signal
+ * and is more stable than the strongest bin alone. The noise floor is taken
+ * as the 20th percentile of the searched bins.
+ */
+bool receiver::find_carrier(double offset, double center, double rbw, double *freq)
+{
+    int half = d_fftLen / 2;
+    int lo = (int)ceil((offset - AFC_SEARCH - center) / rbw) + half;
+    int hi = (int)floor((offset + AFC_SEARCH - center) / rbw) + half;
+    int i, peak;
+    float noise, level;
+    double p, sum = 0.0, wsum = 0.0;
+
+    lo = std::max(lo, 0);
+    hi = std::min(hi, d_fftLen - 1);
+    if (hi - lo < 8)
+        return false;
+
+    std::vector<float> sorted(d_realFftData + lo, d_realFftData + hi + 1);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 5, sorted.end());
+    noise = sorted[sorted.size() / 5];
+
+    peak = lo;
+    for (i = lo; i <= hi; i++)
+        if (d_realFftData[i] > d_realFftData[peak])
+            peak = i;
+
+    if (d_realFftData[peak] - noise < AFC_MIN_SNR)
+        return false;
+
+    level = d_realFftData[peak] - AFC_LOBE;
+    for (i = lo; i <= hi; i++)
+    {
+        if (d_realFftData[i] > level)
+        {
+            p = pow(10.0, d_realFftData[i] / 10.0);
+            sum += p;
+            wsum += p * (i - half);
+        }
     }
 
-    fft_lock.unlock();
+    *freq = center + wsum / sum * rbw;
+
+    return true;
+}
+
+/*! \brief Enable or disable automatic frequency control.
+ *  \param enable Non-zero to track the carriers.
+ */
+void receiver::set_afc(int enable)
+{
+    boost::mutex::scoped_lock lock(d_tune_mutex);
+
+    d_afc = (enable != 0);
+    for (int i = 0; i <= MAX_CHAN; i++)
+        d_afc_valid[i] = false;
+
+    if (d_batch)
+        fft->set_averaging(d_afc);
+}
+
+/*! \brief Get AFC status. */
+int receiver::get_afc(void)
+{
+    return d_afc ? 1 : 0;
 }
 
 /*! \brief Calculate signal to noise ratios. */
 void receiver::process_snr(void)
 {
-    double rbw = d_quad_rate / FFT_SIZE;   // FFT resolution bandwidth
-    int numbins = 200e3 / (int)rbw;
+    double rbw;
+    int numbins;
     int startbin;
     int i;
     double sum = 0.;
     double noise, signal;
 
-    if (d_fftLen <= 0)
+    // zoomed spectrum has no noise reference
+    if (d_fftLen <= 0 || d_fft_zoom > 1)
         return;
 
-    fft_lock.lock();
+    rbw = d_quad_rate / d_fftLen;   // FFT resolution bandwidth
+    numbins = std::max((int)(200e3 / rbw), 1);
 
     // average noise power calculated around 0 Hz
     startbin = d_fftLen/2 - numbins/2;
@@ -638,7 +1447,6 @@ void receiver::process_snr(void)
     {
         sum += (double)d_realFftData[i];
     }
-    fft_lock.unlock();
 
     d_signal = sum / (double) numbins;
 
@@ -706,14 +1514,33 @@ double receiver::snr_to_ampl(double snr)
  *
  * When recording is enabled we start recording an I/Q file connetcted
  * directly to to the UHD source. The filename is of the form:
- *   sapphire_freq_rate_YYYYMMDD-HHMMSS.raw
+ *   sapphire_freq_rate_YYYYMMDD-HHMMSS.ext
+ * where ext is raw, sc16 or sc8 depending on the recording format. The
+ * recording is described by a SigMF metadata file and indexed by a .idx
+ * file of the same name, see iqrec_write_meta() and iqrec_write_index().
  * This function can also be used to restart a recording into a new file.
+ * A recording started by the operator is never stopped by the triggers.
  */
 void receiver::iqrec_enable(int enable)
+{
+    boost::mutex::scoped_lock lock(d_iqrec_mutex);
+
+    d_trig_active = false;
+    iqrec_start_stop(enable);
+}
+
+/*! \brief Start or stop I/Q recording. Must be called with d_iqrec_mutex held. */
+void receiver::iqrec_start_stop(int enable)
 {
     if (d_recording)
     {
-        // stop ongoing recording
+        // stop ongoing recording, the last index record marks its end
+        if (d_iqrec_idx)
+        {
+            iqrec_write_index();
+            fclose(d_iqrec_idx);
+            d_iqrec_idx = NULL;
+        }
         iqrec->close();
     }
 
@@ -722,19 +1549,298 @@ void receiver::iqrec_enable(int enable)
         // start new recording
         int freq = (int)(rx_freq() / 1.e3);   // frequency in kHz
         int rate = (int)(d_quad_rate / 1.e6); // sample rate in Msps
+        const char *ext = d_iqrec_format == strx::IQ_FORMAT_SC16 ? "sc16" :
+                          d_iqrec_format == strx::IQ_FORMAT_SC8 ? "sc8" : "raw";
         char buff[80];
 
-        sprintf(buff, "sapphire_%dkHz_%dMsps_%s.raw", freq, rate, currentDateTime());
+        sprintf(buff, "sapphire_%dkHz_%dMsps_%s.%s", freq, rate, currentDateTime(), ext);
 
-        iqrec->open(buff);
-        iqrec->set_unbuffered(true);
-        iqrec->do_update();
+        iqrec->set_center_freq(rx_freq());
+        enable = iqrec->open(buff);
+        if (enable)
+            iqrec_write_meta(buff);
     }
 
     d_recording = enable;
 }
 
+/*! \brief Write the SigMF metadata and start the index of a new recording.
+ *  \param filename The name of the recording.
+ *
+ * The metadata file holds what the file name can't: the exact frequency
+ * and sample rate, the sample format and the UTC time of the first sample.
+ * SC16 and SC8 recordings are stored in blocks with headers, which is
+ * declared in the strx extension namespace; FC32 recordings are plain
+ * SigMF datasets. Failing to write the metadata or the index is reported
+ * but does not stop the recording. Must be called with d_iqrec_mutex held.
+ */
+void receiver::iqrec_write_meta(const std::string &filename)
+{
+    std::string meta = strx::iq_sidecar_name(filename, ".sigmf-meta");
+    std::string index = strx::iq_sidecar_name(filename, ".idx");
+    const char *datatype;
+    uint64_t offset;
+    int64_t time_ns;
+    time_t secs;
+    struct tm tstruct;
+    char datetime[40];
+    FILE *fp;
+
+    switch (d_iqrec_format)
+    {
+    case strx::IQ_FORMAT_SC16:
+        datatype = "ci16_le";
+        break;
+    case strx::IQ_FORMAT_SC8:
+        datatype = "ci8";
+        break;
+    default:
+        datatype = "cf32_le";
+        break;
+    }
+
+    // the recording may start with the pre-trigger ring
+    iqrec->get_position(&offset, &time_ns);
+    time_ns -= (int64_t)(offset * 1.e9 / d_quad_rate);
+    secs = (time_t)(time_ns / 1000000000);
+    gmtime_r(&secs, &tstruct);
+    strftime(datetime, sizeof(datetime), "%Y-%m-%dT%H:%M:%S", &tstruct);
+
+    fp = fopen(meta.c_str(), "w");
+    if (fp == NULL)
+    {
+        std::cerr << "Can't create " << meta << ": " << strerror(errno) << std::endl;
+    }
+    else
+    {
+        fprintf(fp, "{\n");
+        fprintf(fp, "    \"global\": {\n");
+        fprintf(fp, "        \"core:datatype\": \"%s\",\n", datatype);
+        fprintf(fp, "        \"core:sample_rate\": %.3f,\n", d_quad_rate);
+        fprintf(fp, "        \"core:version\": \"1.0.0\",\n");
+        fprintf(fp, "        \"core:num_channels\": 1,\n");
+        fprintf(fp, "        \"core:dataset\": \"%s\",\n", filename.c_str());
+        fprintf(fp, "        \"core:recorder\": \"strx %s\",\n", VERSION);
+        fprintf(fp, "        \"core:extensions\": [\n");
+        fprintf(fp, "            { \"name\": \"strx\", \"version\": \"1.0.0\", \"optional\": %s }\n",
+                d_iqrec_format == strx::IQ_FORMAT_FC32 ? "true" : "false");
+        fprintf(fp, "        ],\n");
+        if (d_iqrec_format != strx::IQ_FORMAT_FC32)
+            fprintf(fp, "        \"strx:block_size\": %d,\n", IQ_BLOCK_SIZE);
+        fprintf(fp, "        \"strx:index\": \"%s\",\n", index.c_str());
+        fprintf(fp, "        \"strx:lnb_lo\": %.1f,\n", d_lnb_lo);
+        fprintf(fp, "        \"strx:gain\": %.1f\n", rf_gain());
+        fprintf(fp, "    },\n");
+        fprintf(fp, "    \"captures\": [\n");
+        fprintf(fp, "        {\n");
+        fprintf(fp, "            \"core:sample_start\": 0,\n");
+        fprintf(fp, "            \"core:frequency\": %.1f,\n", rx_freq());
+        fprintf(fp, "            \"core:datetime\": \"%s.%06dZ\"\n", datetime,
+                (int)(time_ns % 1000000000 / 1000));
+        fprintf(fp, "        }\n");
+        fprintf(fp, "    ],\n");
+        fprintf(fp, "    \"annotations\": []\n");
+        fprintf(fp, "}\n");
+        if (fclose(fp) != 0)
+            std::cerr << "Error writing " << meta << ": " << strerror(errno) << std::endl;
+    }
+
+    d_iqrec_idx = fopen(index.c_str(), "wb");
+    if (d_iqrec_idx == NULL)
+    {
+        std::cerr << "Can't create " << index << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    strx::iq_index_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IQ_INDEX_MAGIC, 4);
+    hdr.version = IQ_INDEX_VERSION;
+    hdr.rec_len = sizeof(strx::iq_index_record);
+    hdr.period_ms = IQREC_INDEX_PERIOD;
+    hdr.rate = d_quad_rate;
+    fwrite(&hdr, sizeof(hdr), 1, d_iqrec_idx);
+
+    iqrec_write_index();
+}
+
+/*! \brief Append a record to the index of the recording.
+ *
+ * The record ties the current sample offset in the recording to its UTC
+ * time and to the receiver state. It is flushed right away, so the index
+ * of an interrupted recording is usable up to its last record. Must be
+ * called with d_iqrec_mutex held.
+ */
+void receiver::iqrec_write_index(void)
+{
+    strx::iq_index_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    iqrec->get_position(&rec.offset, &rec.time_ns);
+    rec.rf_freq = rx_freq();
+    rec.gain = rf_gain();
+    rec.ch_offs[0] = d_ch_offs[0];
+    rec.ch_offs[1] = d_ch_offs[1];
+    rec.snr = d_last_snr;
+    rec.channel = d_ch;
+    d_iqrec_idx_drops = iqrec->dropped();
+
+    if (fwrite(&rec, sizeof(rec), 1, d_iqrec_idx) != 1 || fflush(d_iqrec_idx) != 0)
+    {
+        std::cerr << "Error writing I/Q recording index: " << strerror(errno) << std::endl;
+        fclose(d_iqrec_idx);
+        d_iqrec_idx = NULL;
+        return;
+    }
+
+    d_iqrec_idx_next = boost::get_system_time() +
+                       boost::posix_time::milliseconds(IQREC_INDEX_PERIOD);
+}
+
+/*! \brief Write the index of the I/Q recording every IQREC_INDEX_PERIOD.
+ *
+ * An extra record is written when samples have been dropped, which places
+ * the gap in the recording to within an FFT frame. Called by the FFT thread
+ * after process_snr(), so that the records carry the latest SNR.
+ */
+void receiver::process_iqrec_index(void)
+{
+    boost::mutex::scoped_lock lock(d_iqrec_mutex);
+
+    if (d_iqrec_idx && (boost::get_system_time() >= d_iqrec_idx_next ||
+                        iqrec->dropped() != d_iqrec_idx_drops))
+        iqrec_write_index();
+}
+
 int receiver::iqrec_enabled(void)
 {
     return d_recording;
 }
+
+/*! \brief Select the I/Q recording triggers.
+ *  \param trigger IQREC_TRIG_* flags, 0 to disable the triggers.
+ *
+ * A triggered recording includes the pre-trigger ring, if enabled, and
+ * continues until no trigger has fired for the post-trigger time.
+ */
+void receiver::set_iqrec_trigger(int trigger)
+{
+    boost::mutex::scoped_lock lock(d_iqrec_mutex);
+
+    d_trig = trigger & (IQREC_TRIG_SNR | IQREC_TRIG_ERRORS);
+
+    // only count errors from now on
+    d_trig_errors = decoder_errors();
+    d_trig_check = boost::get_system_time();
+}
+
+int receiver::get_iqrec_trigger(void)
+{
+    return d_trig;
+}
+
+/*! \brief Get the total number of errors of the in-process decoders. */
+unsigned long long receiver::decoder_errors(void)
+{
+    unsigned long long errors = 0;
+
+    for (int i = 0; i <= MAX_CHAN; i++)
+        if (decoder[i])
+            errors += decoder[i]->errors();
+
+    return errors;
+}
+
+/*! \brief Start and stop I/Q recordings on triggers.
+ *
+ * The SNR trigger fires when the SNR of the active channel drops more than
+ * TRIG_SNR_DROP below its slow average, provided that there was a signal.
+ * The error trigger fires when the in-process decoders report TRIG_ERRORS
+ * or more errors within a second. Called by the FFT thread after
+ * process_snr().
+ */
+void receiver::process_trigger(void)
+{
+    boost::mutex::scoped_lock lock(d_iqrec_mutex);
+    boost::system_time now = boost::get_system_time();
+    bool fire = false;
+
+    // the SNR is not updated while the FFT is zoomed in
+    if ((d_trig & IQREC_TRIG_SNR) && d_fft_zoom == 1)
+    {
+        if (d_trig_snr_ref > TRIG_SNR_MIN && d_last_snr < d_trig_snr_ref - TRIG_SNR_DROP)
+            fire = true;
+        d_trig_snr_ref += TRIG_SNR_ALPHA * (d_last_snr - d_trig_snr_ref);
+    }
+
+    if ((d_trig & IQREC_TRIG_ERRORS) && now >= d_trig_check + boost::posix_time::seconds(1))
+    {
+        unsigned long long errors = decoder_errors();
+
+        if (errors - d_trig_errors >= TRIG_ERRORS)
+            fire = true;
+        d_trig_errors = errors;
+        d_trig_check = now;
+    }
+
+    if (fire)
+    {
+        if (!d_recording)
+        {
+            std::cerr << "I/Q recording triggered" << std::endl;
+            iqrec_start_stop(1);
+            d_trig_active = d_recording;
+        }
+        if (d_trig_active)
+            d_trig_until = now + boost::posix_time::milliseconds((long)(d_trig_post * 1000.0));
+    }
+    else if (d_trig_active && now >= d_trig_until)
+    {
+        iqrec_start_stop(0);
+        d_trig_active = false;
+    }
+}
+
+/*! \brief Store a packet decoded in batch mode.
+ *
+ * Called by the decoder blocks. The packet is stamped with the current
+ * replay position, which trails the packet by the samples buffered in the
+ * flow graph, a few tens of ms at most.
+ */
+void receiver::collect_packet(const packet_info_t &packet)
+{
+    decoded_packet p;
+
+    p.time = src->get_position();
+    p.segment = 0;
+    p.channel = packet.channel;
+    p.crc_ok = packet.crc_ok != 0;
+    p.flag_err = packet.flag_err;
+    p.trellis_err = packet.trellis_err;
+    p.data.assign(packet.data, packet.data + packet.len);
+
+    boost::mutex::scoped_lock lock(d_packets_mutex);
+    d_packets.push_back(p);
+}
+
+/*! \brief Get the packets collected in batch mode and clear the collection. */
+std::vector<decoded_packet> receiver::take_packets(void)
+{
+    std::vector<decoded_packet> packets;
+
+    boost::mutex::scoped_lock lock(d_packets_mutex);
+    packets.swap(d_packets);
+
+    return packets;
+}
+
+/*! \brief Get the number of I/Q samples dropped by the current recording.
+ *
+ * Samples are dropped when the disk can't keep up and the recorder runs out
+ * of buffers, so a non-zero value means the recording has gaps.
+ */
+long receiver::iqrec_dropped(void)
+{
+    return (long)iqrec->dropped();
+}
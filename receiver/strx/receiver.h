@@ -21,12 +21,13 @@
 #define RECEIVER_H
 
 // standard includes
+#include <stdint.h>
+#include <stdio.h>
 #include <string>
 #include <vector>
 
 // Boost includes
 #include <boost/thread.hpp>
-#include <boost/thread/shared_mutex.hpp>
 
 // GNU Radio includes
 #include <gnuradio/analog/quadrature_demod_cf.h>
@@ -34,11 +35,14 @@
 #include <gnuradio/analog/sig_source_waveform.h>
 #include <gnuradio/audio/sink.h>
 #include <gnuradio/blocks/file_sink.h>
+#include <gnuradio/blocks/null_sink.h>
+#include <gnuradio/blocks/stream_to_streams.h>
 #include <gnuradio/blocks/sub_ff.h>
 #include <gnuradio/config.h>
 #include <gnuradio/digital/clock_recovery_mm_ff.h>
 #include <gnuradio/filter/freq_xlating_fir_filter_ccf.h>
 #include <gnuradio/filter/firdes.h>
+#include <gnuradio/filter/pfb_channelizer_ccf.h>
 #include <gnuradio/filter/single_pole_iir_filter_ff.h>
 #include <gnuradio/gr_complex.h>
 #include <gnuradio/top_block.h>
@@ -47,14 +51,35 @@
 #endif
 
 // strx includes
+#include "strx_decoder.h"
 #include "strx_fft.h"
+#include "strx_iq_recorder_c.h"
 #include "strx_source_c.h"
 
 /*! Max number of "memory" channels */
 #define MAX_CHAN 1
 
+/*! Number of published FFT spectra kept for control port readers */
+#define FFT_SNAPSHOTS 3
+
+/*! I/Q recording triggers */
+#define IQREC_TRIG_SNR    1  /*!< Start recording when the SNR drops. */
+#define IQREC_TRIG_ERRORS 2  /*!< Start recording on a burst of decoding errors. */
+
 using namespace gr;
 
+/*! \brief A packet decoded in batch mode. */
+struct decoded_packet
+{
+    double  time;       /*!< Replay position when the packet was decoded (s). */
+    int     segment;    /*!< Batch segment that decoded the packet. */
+    int     channel;    /*!< Downlink channel. */
+    bool    crc_ok;     /*!< The CRC is correct. */
+    unsigned int flag_err;     /*!< Error bits in the flag. */
+    unsigned int trellis_err;  /*!< Error bits corrected by the Trellis code. */
+    std::vector<uint8_t> data; /*!< Length, inverted length, ID, payload and CRC. */
+};
+
 /*! \defgroup RX High level receiver blocks. */
 
 /*! \brief Top-level receiver class.
@@ -71,13 +96,16 @@ class receiver
 public:
 
     receiver(const std::string name, const std::string input, const std::string output,
-             const std::string audio_out, double quad_rate);
+             const std::string audio_out, double quad_rate, bool multi_channel=false,
+             bool decode=false, bool batch=false);
     ~receiver();
 
     void start();
     void stop();
 
     void set_antenna(std::string antenna);
+    void set_replay_speed(double speed);
+    void set_replay_region(double start, double stop, bool loop);
 
     void rf_freq_range(double *start, double *stop, double *step);
     void set_rf_freq(double freq);
@@ -100,20 +128,55 @@ public:
     int  get_active_channel(void);
 
     void set_fft_rate(long rate);
+    long get_fft_rate(void);
+    void set_fft_zoom(int zoom);
+    int  get_fft_zoom(void);
+    void set_fft_size(int size);
+    int  get_fft_size(void);
+    void set_fft_round(bool round);
+    void set_fft_window(int wintype);
+    int  get_fft_window(void);
+    void prepare_fft_sizes(const std::vector<int> &sizes);
+    bool wait_fft(int timeout_ms);
 
     void process_fft(void);
+    void process_afc(void);
     void process_snr(void);
+    void process_trigger(void);
+    void process_iqrec_index(void);
     double snr_to_freq(double snr);
     double snr_to_ampl(double snr);
 
     std::vector<float> get_fft_data(void);
+    long get_fft_generation(void);
     double get_snr(void);
 
     void iqrec_enable(int enable);
+    void set_iqrec_format(int format) { d_iqrec_format = format; iqrec->set_format(format); }
+    void set_iqrec_pretrigger(double seconds) { iqrec->set_pretrigger(seconds); }
+    void set_iqrec_trigger(int trigger);
+    int  get_iqrec_trigger(void);
+    void set_iqrec_post(double seconds) { d_trig_post = seconds; }
     int iqrec_enabled(void);
+    long iqrec_dropped(void);
+
+    void set_afc(int enable);
+    int  get_afc(void);
+
+    std::vector<decoded_packet> take_packets(void);
 
 private:
     void connect_all(void);
+    int  channelizer_output(int channel);
+    void tune_channel(int channel);
+    void update_fft_zoom(void);
+    void retune_channel(int channel, double freq_hz);
+    void iqrec_start_stop(int enable);
+    void iqrec_write_meta(const std::string &filename);
+    void iqrec_write_index(void);
+    unsigned long long decoder_errors(void);
+    void collect_packet(const packet_info_t &packet);
+    bool find_carrier(double offset, double center, double rbw, double *freq);
 
 #ifdef GR_CTRLPORT
 protected:
@@ -142,13 +205,22 @@ private:
     strx::fft_c::sptr                          fft;    /*!< Receiver FFT block. */
     std::vector<float>                        taps;   /*!< Channel filter taps. */
     filter::freq_xlating_fir_filter_ccf::sptr  filter; /*!< Channel filter. */
-    analog::quadrature_demod_cf::sptr          demod;  /*!< Demodulator. */
-    filter::single_pole_iir_filter_ff::sptr    iir;    /*!< IIR filter for carrier offset estimation. */
-    blocks::sub_ff::sptr                       sub;    /*!< Carrier offset correction. */
-    
-    digital::clock_recovery_mm_ff::sptr        clock_recov; /*!< M&M clock recovery block .*/
-    blocks::file_sink::sptr                    iqrec;   /*!< I/Q recorder block. */
-    blocks::file_sink::sptr                    fifo;    /*!< Demodulator output. */
+
+    // multi-channel mode: polyphase channelizer followed by a fine tuner per channel
+    blocks::stream_to_streams::sptr            ch_s2ss;      /*!< Input commutator for the channelizer. */
+    filter::pfb_channelizer_ccf::sptr          channelizer;  /*!< Polyphase channelizer. */
+    filter::freq_xlating_fir_filter_ccf::sptr  tuner[MAX_CHAN+1];  /*!< Fine tuning within the channelizer output. */
+    blocks::null_sink::sptr                    ch_null;      /*!< Sink for unused channelizer outputs. */
+
+    // demodulator chains; only chain 0 is used in single-channel mode
+    analog::quadrature_demod_cf::sptr          demod[MAX_CHAN+1];  /*!< Demodulator. */
+    filter::single_pole_iir_filter_ff::sptr    iir[MAX_CHAN+1];    /*!< IIR filter for carrier offset estimation. */
+    blocks::sub_ff::sptr                       sub[MAX_CHAN+1];    /*!< Carrier offset correction. */
+    digital::clock_recovery_mm_ff::sptr        clock_recov[MAX_CHAN+1]; /*!< M&M clock recovery block .*/
+    blocks::file_sink::sptr                    fifo[MAX_CHAN+1];   /*!< Demodulator output. */
+    strx::decoder_f::sptr                      decoder[MAX_CHAN+1]; /*!< In-process packet decoder. */
+
+    strx::iq_recorder_c::sptr                  iqrec;   /*!< I/Q recorder block. */
 
     // audio SSI blocks
     analog::sig_source_f::sptr                 trk_sig;  /*!< Audio signal source. */
@@ -164,16 +236,56 @@ private:
     double d_cutoff;             /*!< Channel filter cutoff (1/2 BW). */
     double d_ch_offs[MAX_CHAN+1];  /*!< Channel offsets from center (Hz). */
     int    d_ch;                  /*!< Active channel. */
+    bool   d_multi;               /*!< Demodulate all channels in parallel. */
+    bool   d_decode;              /*!< Decode packets in-process instead of writing soft symbols. */
+    bool   d_batch;               /*!< Collect the decoded packets instead of delivering them. */
+    std::vector<decoded_packet> d_packets; /*!< Packets collected in batch mode. */
+    boost::mutex d_packets_mutex; /*!< Protects d_packets, filled by the decoder threads. */
+    int    d_nfilts;              /*!< Number of channelizer outputs. */
+    int    d_ch_out[MAX_CHAN+1];  /*!< Channelizer output used by each channel. */
 
     // FFT stuff
     boost::thread        fft_thread;  /*!< FFT thread. */
-    boost::shared_mutex  fft_lock;    /*!< Mutex for locking FFT data while processing and reading. */
-    std::complex<float>*  d_fftData;
+    long   d_fft_rate;    /*!< Max FFT updates per second. */
+    int    d_fft_zoom;    /*!< FFT zoom factor around the active channel, 1 for full band. */
+    bool   d_fft_round;   /*!< Round FFT sizes to FFTW friendly sizes. */
+    float *d_psdData;     /*!< Averaged power spectrum returned by FFT block. */
     int    d_fftLen;  /*!< Number of points returned by FFT block. */
     float *d_realFftData; /** FIXME: use vector */
     float *d_iirFftData;  /** FIXME: use vector */
     float  d_fftAvg;      /*!< FFT averaging parameter set by user (not the true gain). */
+
+    /* Published spectra. The FFT thread is the only writer and fills the
+     * slots round-robin; readers never lock and retry if the slot they
+     * copied has been reused meanwhile.
+     */
+    float   *d_snapData[FFT_SNAPSHOTS]; /*!< Published spectra (dBFS). */
+    int      d_snapLen[FFT_SNAPSHOTS];  /*!< Number of points in each slot. */
+    uint64_t d_fft_writing;  /*!< Generation being published. */
+    uint64_t d_fft_gen;      /*!< Generation of the latest published spectrum. */
     int    d_recording;   /*!< I/Q recording enabled. */
+    int    d_iqrec_format; /*!< I/Q recording format, see strx::iq_format_e. */
+    boost::mutex d_iqrec_mutex; /*!< Serializes recording control by the operator and the triggers. */
+    FILE  *d_iqrec_idx;    /*!< Index file of the current recording or NULL. */
+    boost::system_time d_iqrec_idx_next; /*!< Time of the next index record. */
+    uint64_t d_iqrec_idx_drops; /*!< Dropped samples at the last index record. */
+
+    // I/Q recording triggers
+    int    d_trig;                     /*!< Enabled triggers, IQREC_TRIG_* flags. */
+    bool   d_trig_active;              /*!< The current recording was started by a trigger. */
+    double d_trig_post;                /*!< Recording time after the last trigger (s). */
+    double d_trig_snr_ref;             /*!< Slow SNR average the SNR trigger compares with (dB). */
+    unsigned long long d_trig_errors;  /*!< Decoder error count at the last check. */
+    boost::system_time d_trig_check;   /*!< Time of the last decoder error check. */
+    boost::system_time d_trig_until;   /*!< End of the triggered recording. */
+
+    // AFC stuff
+    bool   d_afc;                      /*!< Automatic frequency control enabled. */
+    double d_afc_nominal[MAX_CHAN+1];  /*!< Channel offsets set by the operator (Hz). */
+    double d_afc_est[MAX_CHAN+1];      /*!< Smoothed carrier offsets (Hz). */
+    bool   d_afc_valid[MAX_CHAN+1];    /*!< Whether d_afc_est is valid. */
+    int    d_afc_holdoff;              /*!< Number of FFT frames to ignore after retuning. */
+    boost::mutex d_tune_mutex;         /*!< Serializes retuning by the operator and the AFC. */
 
     // SNR stuff;
     bool   d_use_audio; /*!< Whether we use audio SNR or not. */
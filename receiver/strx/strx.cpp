@@ -17,11 +17,14 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#include "batch.h"
 #include "receiver.h"
 
 // other includes
+#include <boost/bind.hpp>
 #include <boost/program_options.hpp>
 #include <iostream>
+#include <sstream>
 #include <string>
 
 namespace po = boost::program_options;
@@ -57,34 +60,115 @@ double arg_to_freq(const std::string arg)
     return freq;
 }
 
+/*! \brief Create a receiver and configure it from the command line.
+ *  \param vm The command line options.
+ *  \param segment The batch segment number, -1 for a normal receiver.
+ *
+ * Batch receivers get a name of their own, as the names have to be unique
+ * for ctrlport, and neither audio output nor I/Q recording.
+ */
+static receiver *make_receiver(const po::variables_map &vm, int segment)
+{
+    std::string name = vm["name"].as<std::string>();
+    std::string audio_out = vm["audio"].as<std::string>();
+    std::string iqrec_format = vm["iqrec-format"].as<std::string>();
+    std::string iqrec_trigger = vm["iqrec-trigger"].as<std::string>();
+    std::vector<int> fft_sizes;
+    bool batch = segment >= 0;
+    receiver *rx;
+
+    if (batch)
+    {
+        std::ostringstream s;
+
+        s << (name.empty() ? "strx" : name) << "_" << segment;
+        name = s.str();
+        audio_out = "none";
+    }
+
+    rx = new receiver(name, vm["input"].as<std::string>(), vm["output"].as<std::string>(),
+                      audio_out, 4.e6, vm["multi"].as<bool>(), vm["decode"].as<bool>(), batch);
+
+    if (vm.count("freq"))
+    {
+        rx->set_rf_freq(arg_to_freq(vm["freq"].as<std::string>()));
+    }
+    if (vm.count("gain"))
+    {
+        rx->set_rf_gain(vm["gain"].as<double>());
+    }
+    if (vm.count("ant"))
+    {
+        rx->set_antenna(vm["ant"].as<std::string>());
+    }
+    if (vm.count("lnb"))
+    {
+        rx->set_lnb_lo(arg_to_freq(vm["lnb"].as<std::string>()));
+    }
+    rx->set_replay_speed(vm["speed"].as<double>());
+    rx->set_replay_region(vm["start"].as<double>(), vm["stop"].as<double>(), !vm["no-loop"].as<bool>());
+    if (!batch)
+    {
+        rx->set_iqrec_format(iqrec_format == "sc16" ? strx::IQ_FORMAT_SC16 :
+                             iqrec_format == "sc8" ? strx::IQ_FORMAT_SC8 : strx::IQ_FORMAT_FC32);
+        rx->set_iqrec_pretrigger(vm["iqrec-pre"].as<double>());
+        rx->set_iqrec_post(vm["iqrec-post"].as<double>());
+        rx->set_iqrec_trigger((iqrec_trigger == "snr" || iqrec_trigger == "all" ? IQREC_TRIG_SNR : 0) |
+                              (iqrec_trigger == "errors" || iqrec_trigger == "all" ? IQREC_TRIG_ERRORS : 0));
+    }
+    rx->set_fft_round(vm["fft-round"].as<bool>());
+    rx->set_afc(vm["afc"].as<bool>());
+    if (vm.count("fft-size"))
+    {
+        fft_sizes = vm["fft-size"].as<std::vector<int> >();
+        rx->prepare_fft_sizes(fft_sizes);
+        rx->set_fft_size(fft_sizes[0]);
+    }
+
+    return rx;
+}
+
 int main(int argc, char **argv)
 {
     receiver *rx;
 
-    // command line options
-    std::string freq_str;
-    std::string lnb_str;
-    std::string ant_str;
-    double freq;
-    double lnb;
-    double gain;
+    // command line options, the receiver settings are read by make_receiver()
     bool clierr=false;
-    std::string rxname;
+    bool batch=false;
+    int jobs;
+    double start;
+    double stop;
     std::string input;
     std::string output;
-    std::string audio_out;
+    std::string iqrec_format;
+    std::string iqrec_trigger;
 
     po::options_description desc("Command line options");
     desc.add_options()
         ("help,h", "This help message")
-        ("name,n", po::value<std::string>(&rxname)->default_value(""), "Receiver name (used for ctrlport)")
+        ("name,n", po::value<std::string>()->default_value(""), "Receiver name (used for ctrlport)")
         ("input,i", po::value<std::string>(&input)->default_value(""), "USRP sub device or I/Q file (use file:/path/to/file)")
-        ("ant,a", po::value<std::string>(&ant_str), "Select USRP antenna (e.g. RX2)")
-        ("freq,f", po::value<std::string>(&freq_str), "RF frequency in Hz or using G, M, k suffix")
-        ("gain,g", po::value<double>(&gain), "RF/IF gain in dB")
-        ("lnb,l", po::value<std::string>(&lnb_str), "LNB LO frequency in Hz or using G, M, k suffix")
+        ("ant,a", po::value<std::string>(), "Select USRP antenna (e.g. RX2)")
+        ("freq,f", po::value<std::string>(), "RF frequency in Hz or using G, M, k suffix")
+        ("gain,g", po::value<double>(), "RF/IF gain in dB")
+        ("lnb,l", po::value<std::string>(), "LNB LO frequency in Hz or using G, M, k suffix")
         ("output,o", po::value<std::string>(&output)->default_value(""), "Output file (use stdout if omitted)")
-        ("audio", po::value<std::string>(&audio_out)->default_value("none"), "Audio output device (e.g. pulse, none)")
+        ("multi,m", po::bool_switch(), "Demodulate all channels at once, one output per channel (%d in output is the channel)")
+        ("decode,d", po::bool_switch(), "Decode packets in-process instead of writing soft symbols to the output")
+        ("audio", po::value<std::string>()->default_value("none"), "Audio output device (e.g. pulse, none)")
+        ("fft-size", po::value<std::vector<int> >()->multitoken(), "FFT size, further sizes are prepared for later use (default 4000)")
+        ("fft-round", po::bool_switch(), "Round FFT sizes up to sizes FFTW handles well")
+        ("afc", po::bool_switch(), "Track the carrier frequency automatically")
+        ("speed", po::value<double>()->default_value(1.0), "I/Q file replay speed (0 = as fast as possible)")
+        ("start", po::value<double>(&start)->default_value(0.0), "I/Q file replay start in seconds")
+        ("stop", po::value<double>(&stop)->default_value(0.0), "I/Q file replay stop in seconds (0 = end of file)")
+        ("no-loop", po::bool_switch(), "Exit at the end of the I/Q file instead of looping")
+        ("batch", po::bool_switch(&batch), "Decode the I/Q file as fast as possible on all cores and write the packets to the output")
+        ("jobs,j", po::value<int>(&jobs)->default_value(0), "Number of parts of the I/Q file decoded in parallel in batch mode (0 = one per core)")
+        ("iqrec-format", po::value<std::string>(&iqrec_format)->default_value("fc32"), "I/Q recording format (fc32, sc16 or sc8)")
+        ("iqrec-pre", po::value<double>()->default_value(0.0), "Seconds of I/Q kept in RAM and written ahead of each recording")
+        ("iqrec-trigger", po::value<std::string>(&iqrec_trigger)->default_value("none"), "Start I/Q recording automatically (none, snr, errors or all)")
+        ("iqrec-post", po::value<double>()->default_value(10.0), "Seconds to keep recording after the last trigger")
     ;
     po::variables_map vm;
     try
@@ -97,34 +181,26 @@ int main(int argc, char **argv)
     }
     po::notify(vm);
 
+    if (iqrec_format != "fc32" && iqrec_format != "sc16" && iqrec_format != "sc8")
+        clierr = true;
+    if (iqrec_trigger != "none" && iqrec_trigger != "snr" && iqrec_trigger != "errors" && iqrec_trigger != "all")
+        clierr = true;
+
     if (vm.count("help") || clierr)
     {
         std::cout << "Sapphire telemetry receiver " << VERSION << std::endl << desc << std::endl;
         return 1;
     }
 
-    // create receiver and set paarameters
-    rx = new receiver(rxname, input, output, audio_out, 4.e6);
-
-    if (vm.count("freq"))
+    if (batch)
     {
-        freq = arg_to_freq(freq_str);
-        rx->set_rf_freq(freq);
-    }
-    if (vm.count("gain"))
-    {
-        rx->set_rf_gain(gain);
-    }
-    if (vm.count("ant"))
-    {
-        rx->set_antenna(ant_str);
-    }
-    if (vm.count("lnb"))
-    {
-        lnb = arg_to_freq(lnb_str);
-        rx->set_lnb_lo(lnb);
+        return batch_decode(input, 4.e6, output, jobs, start, stop,
+                            boost::bind(&make_receiver, boost::cref(vm), _1));
     }
 
+    // create receiver and set paarameters
+    rx = make_receiver(vm, -1);
+
     rx->start();
 
     delete rx;
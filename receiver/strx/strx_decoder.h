@@ -0,0 +1,69 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gqrx; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef STRX_DECODER_H
+#define STRX_DECODER_H
+
+#include <boost/function.hpp>
+#include <gnuradio/sync_block.h>
+
+#include "correlator.h"
+#include "strx_api.h"
+
+
+namespace strx {
+
+    /*! Strx packet decoder block.
+     *
+     * Runs the data decoder (correlator, Viterbi decoder and packet delivery)
+     * directly on the soft symbols coming out of the clock recovery. This is
+     * the same processing as done by the external correlator process, without
+     * the pipe in between.
+     *
+     * The decoded packets are delivered to the same TCP ports as used by the
+     * correlator. The ports are shared by all decoder instances in the process
+     * and served by a thread started together with the first instance.
+     * Alternatively the packets are passed to a handler, e.g. for offline
+     * decoding, and the ports are not opened.
+     */
+    class STRX_API decoder_f : virtual public gr::sync_block
+    {
+    public:
+
+        typedef boost::shared_ptr<decoder_f> sptr;
+
+        /*! \brief Packet handler, called from the scheduler thread of the block. */
+        typedef boost::function<void (const packet_info_t &)> packet_handler;
+
+        /*! \brief Return a shared_ptr to a new instance of strx::decoder_f.
+         *  \param channel The channel number used in the packet log.
+         *  \param handler Receives the packets instead of the TCP ports if set.
+         */
+        static sptr make(int channel=0, packet_handler handler=packet_handler());
+
+        /*! \brief Get the number of decoding errors so far.
+         *  \returns The number of invalid headers plus the number of packets
+         *           failing the CRC check.
+         */
+        virtual unsigned long long errors() = 0;
+    };
+
+} // namespace strx
+
+#endif // STRX_DECODER_H
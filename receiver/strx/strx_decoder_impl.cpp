@@ -0,0 +1,149 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gqrx; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#include <stdexcept>
+#include <gnuradio/io_signature.h>
+
+#include "sockets.h"
+#include "strx_decoder_impl.h"
+
+namespace strx {
+
+    boost::mutex  decoder_f_impl::s_mutex;
+    bool          decoder_f_impl::s_tables = false;
+    int           decoder_f_impl::s_instances = 0;
+    boost::thread decoder_f_impl::s_thread;
+
+    decoder_f::sptr decoder_f::make(int channel, packet_handler handler)
+    {
+        return gnuradio::get_initial_sptr(new decoder_f_impl(channel, handler));
+    }
+
+    decoder_f_impl::decoder_f_impl(int channel, packet_handler handler)
+      : gr::sync_block("strx_decoder_f",
+                       gr::io_signature::make(1, 1, sizeof (float)),
+                       gr::io_signature::make(0, 0, 0)),
+        d_errors(0),
+        d_handler(handler)
+    {
+        boost::mutex::scoped_lock lock(s_mutex);
+
+        // the tables are shared by all decoders
+        if (!s_tables)
+        {
+            init_trellis_encoder();
+            init_crc_table();
+            s_tables = true;
+        }
+
+        d_cor = new_correlator(channel);
+        if (d_handler)
+        {
+            set_packet_handler(d_cor, &decoder_f_impl::handler_func, this);
+            return;
+        }
+
+        // the first instance sets up the sockets shared by all decoders
+        if (s_instances == 0)
+        {
+            if (init_sockets() < 0)
+            {
+                delete_correlator(d_cor);
+                throw std::runtime_error("strx_decoder_f: can not create the distribution sockets");
+            }
+
+            s_thread = boost::thread(&decoder_f_impl::socket_thread_func);
+        }
+        s_instances++;
+    }
+
+    decoder_f_impl::~decoder_f_impl()
+    {
+        boost::mutex::scoped_lock lock(s_mutex);
+
+        delete_correlator(d_cor);
+
+        if (!d_handler && --s_instances == 0)
+        {
+            s_thread.interrupt();
+            s_thread.join();
+            close_sockets();
+        }
+    }
+
+    /*! \brief Pass a packet from the correlator on to the packet handler. */
+    void decoder_f_impl::handler_func(void *arg, const packet_info_t *packet)
+    {
+        decoder_f_impl *self = (decoder_f_impl *)arg;
+
+        self->d_handler(*packet);
+    }
+
+    /*! \brief Socket thread function.
+     *
+     * Serves new subscribers, the send queues and the monitor port. The
+     * epoll wait in wait_sockets() times out after 100 ms, so the thread
+     * checks for interruption at least that often.
+     */
+    void decoder_f_impl::socket_thread_func()
+    {
+        try
+        {
+            for (;;)
+            {
+                if (wait_sockets(-1, 100) < 0)
+                    return;
+
+                boost::this_thread::interruption_point();
+            }
+        }
+        catch(boost::thread_interrupted&)
+        {
+            return;
+        }
+    }
+
+    /*! \brief Decoder work method.
+     *
+     * Feeds the soft symbols to the correlator. Decoding and delivery of the
+     * packets happen right here in the scheduler thread, so a slow decoder
+     * throttles the flow graph instead of overflowing a pipe.
+     */
+    int decoder_f_impl::work(int noutput_items,
+                             gr_vector_const_void_star &input_items,
+                             gr_vector_void_star &output_items)
+    {
+        const float *in = (const float*)input_items[0];
+        correlator_stats_t stats;
+        (void) output_items;
+
+        stuff_samples(d_cor, in, noutput_items);
+
+        get_correlator_stats(d_cor, &stats);
+        __atomic_store_n(&d_errors, stats.header_errors + stats.bad, __ATOMIC_RELAXED);
+
+        return noutput_items;
+    }
+
+    unsigned long long decoder_f_impl::errors()
+    {
+        return __atomic_load_n(&d_errors, __ATOMIC_RELAXED);
+    }
+
+} // namespace strx
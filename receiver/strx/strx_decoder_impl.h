@@ -0,0 +1,59 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gqrx; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef INCLUDED_STRX_DECODER_IMPL_H
+#define INCLUDED_STRX_DECODER_IMPL_H
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "correlator.h"
+#include "strx_decoder.h"
+
+namespace strx {
+
+    class decoder_f_impl : public decoder_f
+    {
+    public:
+        decoder_f_impl(int channel, packet_handler handler);
+        ~decoder_f_impl();
+
+        int work(int noutput_items,
+                 gr_vector_const_void_star &input_items,
+                 gr_vector_void_star &output_items);
+
+        unsigned long long errors();
+
+    private:
+        correlator_t *d_cor;    /*! Correlator state machine. */
+        unsigned long long d_errors;  /*! Error count published by work() for errors(). */
+        packet_handler d_handler; /*! Packet handler, empty when delivering to the sockets. */
+
+        static void handler_func(void *arg, const packet_info_t *packet);
+        static void socket_thread_func();
+
+        static boost::mutex  s_mutex;      /*! Protects the shared state below. */
+        static bool          s_tables;     /*! The trellis encoder and CRC tables are initialized. */
+        static int           s_instances;  /*! Number of decoder instances using the sockets. */
+        static boost::thread s_thread;     /*! Thread serving the distribution sockets. */
+    };
+
+} // namespace strx
+
+#endif /* INCLUDED_STRX_DECODER_IMPL_H */
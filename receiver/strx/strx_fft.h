@@ -20,8 +20,6 @@
 #ifndef STRX_FFT_H
 #define STRX_FFT_H
 
-#include <boost/circular_buffer.hpp>
-#include <boost/thread/mutex.hpp>
 #include <gnuradio/filter/firdes.h>       /* contains enum win_type */
 #include <gnuradio/gr_complex.h>
 #include <gnuradio/sync_block.h>
@@ -29,6 +27,7 @@
 #include "strx_api.h"
 
 #define MAX_FFT_SIZE 32768
+#define MAX_FFT_ZOOM 64
 
 
 namespace strx {
@@ -37,10 +36,21 @@ namespace strx {
      * 
      * Compute complex FFT of the received samples.
      *
-     * The samples are collected in a circular buffer with size d_fftsize.
-     * When users ask for a new set of FFT data via get_fft_data() an FFT is
-     * performed on the data stored in the circular buffer provided that the
-     * at least d_fftsize samples in the buffer.
+     * The samples are collected in a lock-free ring buffer. When users ask
+     * for a new set of FFT data via get_fft_data() an FFT is performed on the
+     * latest d_fftsize samples in the ring, provided that at least d_fftsize
+     * new samples have arrived since the previous FFT.
+     *
+     * With averaging enabled a worker thread transforms the whole stream
+     * instead, in 50% overlapping windowed segments, and accumulates the
+     * power of each bin (Welch's method). get_psd_data() then returns the
+     * average over all segments since the previous call.
+     *
+     * In zoom mode the averaging thread first shifts the zoom center down to
+     * 0 Hz, low pass filters and decimates the stream, and then averages the
+     * decimated stream. The averaged spectrum then covers only a fraction of
+     * the input bandwidth with a correspondingly finer resolution, for
+     * about the same CPU load.
      *
      * \note Used qtgui_sink_c as starting point.
      */
@@ -63,6 +73,32 @@ namespace strx {
          */
         virtual void get_fft_data(std::complex<float>* fft_points, int &fft_size) = 0;
 
+        /*! \brief Get the averaged power spectrum.
+         *  \param psd The average power of each bin, |X|^2 / fftsize^2, in FFT order.
+         *  \param fft_size The number of points in the psd array. This number will either be
+         *                   FFT size or 0 if no segment has been transformed since the last call.
+         *
+         * Requires averaging to be enabled.
+         */
+        virtual void get_psd_data(float* psd, int &fft_size) = 0;
+
+        /*! \brief Wait for averaged power spectrum data.
+         *  \param timeout_ms Max time to wait in milliseconds.
+         *  \returns True if get_psd_data() has data to return.
+         *
+         * Returns as soon as the first segment since the last get_psd_data()
+         * call has been accumulated. This is a boost thread interruption point.
+         */
+        virtual bool wait_psd_data(int timeout_ms) = 0;
+
+        /*! \brief Enable or disable continuous averaging.
+         *  \param enable Whether the worker thread should transform the whole stream.
+         */
+        virtual void set_averaging(bool enable) = 0;
+
+        /*! \brief Get the averaging state. */
+        virtual bool get_averaging() = 0;
+
         /*! \brief Set new window type.
          *  \param wintype See filter/firdes.h
          */
@@ -75,6 +111,9 @@ namespace strx {
 
         /*! \brief Set new FFT size.
          *  \param fftsize The new FFT size.
+         *
+         * The FFT plan is built by a background thread unless it has been
+         * built before. The old size stays in use until the plan is ready.
          */
         virtual void set_fft_size(int fftsize) = 0;
 
@@ -83,6 +122,32 @@ namespace strx {
          */
         virtual int get_fft_size() = 0;
 
+        /*! \brief Build FFT plans in the background.
+         *  \param sizes FFT sizes that may be used later.
+         *
+         * Measuring FFTW plans can take seconds for sizes not found in the
+         * FFTW wisdom; preparing them ahead makes later size changes instant.
+         */
+        virtual void prepare_fft_sizes(const std::vector<int> &sizes) = 0;
+
+        /*! \brief Round an FFT size up to one FFTW handles well.
+         *  \param fftsize The requested FFT size.
+         *  \returns The smallest size >= fftsize with no prime factors above 7.
+         */
+        static int fftw_size(int fftsize);
+
+        /*! \brief Set zoom.
+         *  \param decim Decimation factor, 1 to average the full band.
+         *  \param center Center of the zoomed span relative to the sample rate (-0.5...0.5).
+         *
+         * In zoom mode get_psd_data() returns the spectrum of the 1/decim wide
+         * span around center; get_fft_data() is not affected.
+         */
+        virtual void set_zoom(int decim, double center) = 0;
+
+        /*! \brief Get current zoom decimation factor. */
+        virtual int get_zoom() = 0;
+
     };
 
 } // namespace strx
@@ -17,11 +17,44 @@
  * the Free Software Foundation, Inc., 51 Franklin Street,
  * Boston, MA 02110-1301, USA.
  */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
 #include <gnuradio/io_signature.h>
 #include "strx_fft_impl.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace strx {
 
+    /*! \brief Copy complex samples and apply the FFT window on the way.
+     *  \param dst Destination buffer.
+     *  \param src Source buffer.
+     *  \param win Window taps, each one twice (for I and Q).
+     *  \param n Number of complex samples.
+     */
+    static void copy_window(gr_complex *dst, const gr_complex *src, const float *win, int n)
+    {
+        float *d = (float *)dst;
+        const float *s = (const float *)src;
+        int i = 0;
+
+#ifdef __SSE2__
+        // two complex samples per step
+        for (; i + 2 <= n; i += 2)
+            _mm_storeu_ps(d + 2 * i, _mm_mul_ps(_mm_loadu_ps(s + 2 * i), _mm_loadu_ps(win + 2 * i)));
+#endif
+        for (; i < n; i++)
+        {
+            d[2 * i] = s[2 * i] * win[2 * i];
+            d[2 * i + 1] = s[2 * i + 1] * win[2 * i + 1];
+        }
+    }
+
     fft_c::sptr fft_c::make(int fftsize, int wintype)
     {
         return gnuradio::get_initial_sptr(new fft_c_impl(fftsize, wintype));
@@ -32,21 +65,54 @@ namespace strx {
                        gr::io_signature::make(1, 1, sizeof (gr_complex)),
                        gr::io_signature::make(0, 0, 0)),
         d_fftsize(fftsize),
-        d_wintype(-1)
+        d_wintype(-1),
+        d_writing(0),
+        d_written(0),
+        d_last_read(0),
+        d_averaging(false),
+        d_seg_pos(0),
+        d_psd_count(0),
+        d_plan_size(0),
+        d_decim(1),
+        d_zoom_center(0.0),
+        d_zoom_filter(NULL),
+        d_zoom_in_len(0),
+        d_zoom_len(0)
     {
-        // create FFT object
-        d_fft = new gr::fft::fft_complex(d_fftsize, true, 1);
+        if (d_fftsize > MAX_FFT_SIZE)
+            d_fftsize = MAX_FFT_SIZE;
+
+        // FFT object is created by the planner thread
+        d_fft = NULL;
 
-        // allocate circular buffer
-        d_cbuf.set_capacity(d_fftsize);
+        // allocate sample ring
+        d_ring = new gr_complex[FFT_RING_SIZE];
 
         // create FFT window
-        set_window_type(wintype);
+        if (posix_memalign((void **)&d_window, 64, 2 * MAX_FFT_SIZE * sizeof(float)))
+            throw std::bad_alloc();
+        make_window(wintype);
+
+        d_psd_acc.resize(d_fftsize, 0.0f);
+        d_zoom_out.resize(MAX_FFT_SIZE);
+        d_thread = boost::thread(&fft_c_impl::welch_thread, this);
+        d_planner = boost::thread(&fft_c_impl::planner_thread, this);
+        set_fft_size(d_fftsize);
     }
 
     fft_c_impl::~fft_c_impl()
     {
-        delete d_fft;
+        std::map<int, gr::fft::fft_complex*>::iterator it;
+
+        d_planner.interrupt();
+        d_planner.join();
+        d_thread.interrupt();
+        d_thread.join();
+        for (it = d_plans.begin(); it != d_plans.end(); ++it)
+            delete it->second;
+        delete d_zoom_filter;
+        delete [] d_ring;
+        free(d_window);
     }
 
     /*! \brief Receiver FFT work method.
@@ -54,91 +120,436 @@ namespace strx {
      *  \param input_items
      *  \param output_items
      *
-     * This method does nothing except throwing the incoming samples into the
-     * circular buffer. FFT is only executed when the GUI asks for new FFT data via get_fft_data().
+     * This method does nothing except copying the incoming samples into the
+     * sample ring. FFT is only executed when the GUI asks for new FFT data via
+     * get_fft_data(). No lock is taken, so the scheduler thread is never held
+     * up by the FFT thread; if the reader is too slow the oldest samples are
+     * simply overwritten.
      */
     int fft_c_impl::work(int noutput_items,
                          gr_vector_const_void_star &input_items,
                          gr_vector_void_star &output_items)
     {
-        int i;
         const gr_complex *in = (const gr_complex*)input_items[0];
+        uint64_t w = d_written;     // only written by this thread
+        int n = noutput_items;
+        int pos, chunk;
         (void) output_items;
 
-        // just throw new samples into the buffer
-        boost::mutex::scoped_lock lock(d_mutex);
-        for (i = 0; i < noutput_items; i++)
+        // only the last FFT_RING_SIZE samples can be kept
+        if (n > FFT_RING_SIZE)
         {
-            d_cbuf.push_back(in[i]);
+            in += n - FFT_RING_SIZE;
+            w += n - FFT_RING_SIZE;
+            n = FFT_RING_SIZE;
         }
 
+        // announce the samples about to be overwritten before touching them
+        __atomic_store_n(&d_writing, w + n, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        pos = w & (FFT_RING_SIZE - 1);
+        chunk = std::min(n, FFT_RING_SIZE - pos);
+        memcpy(&d_ring[pos], in, sizeof(gr_complex) * chunk);
+        memcpy(&d_ring[0], in + chunk, sizeof(gr_complex) * (n - chunk));
+
+        __atomic_store_n(&d_written, w + n, __ATOMIC_RELEASE);
+
         return noutput_items;
     }
 
+    /*! \brief Copy samples out of the sample ring.
+     *  \param dst Destination buffer.
+     *  \param start Sample number of the first sample to copy.
+     *  \param size Number of samples to copy.
+     *  \param window Whether to apply the FFT window while copying.
+     *  \returns True if the samples were intact, false if work() overwrote
+     *            some of them while copying.
+     *
+     * Windowing is fused into the copy, so the FFT input is only written once.
+     */
+    bool fft_c_impl::read_ring(gr_complex *dst, uint64_t start, int size, bool window)
+    {
+        int pos = start & (FFT_RING_SIZE - 1);
+        int chunk = std::min(size, FFT_RING_SIZE - pos);
+
+        if (window)
+        {
+            copy_window(dst, &d_ring[pos], d_window, chunk);
+            copy_window(dst + chunk, &d_ring[0], d_window + 2 * chunk, size - chunk);
+        }
+        else
+        {
+            memcpy(dst, &d_ring[pos], sizeof(gr_complex) * chunk);
+            memcpy(dst + chunk, &d_ring[0], sizeof(gr_complex) * (size - chunk));
+        }
+
+        // the oldest sample must not have been reached by the writer
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        return __atomic_load_n(&d_writing, __ATOMIC_RELAXED) <= start + FFT_RING_SIZE;
+    }
+
     void fft_c_impl::get_fft_data(std::complex<float>* fftPoints, int &fftSize)
     {
         boost::mutex::scoped_lock lock(d_mutex);
+        uint64_t w;
+        int tries;
 
-        if (d_cbuf.size() < d_fftsize)
+        fftSize = 0;
+        if (d_fft == NULL)
+            return;
+
+        for (tries = 0; tries < 3; tries++)
         {
-            // not enough samples in the buffer
-            fftSize = 0;
+            w = __atomic_load_n(&d_written, __ATOMIC_ACQUIRE);
+            if (w - d_last_read < (uint64_t)d_fftsize)
+                break;
 
-            return;
+            // transform the latest d_fftsize samples
+            if (read_ring(d_fft->get_inbuf(), w - d_fftsize, d_fftsize, true))
+            {
+                d_last_read = w;
+                d_fft->execute();
+
+                // get FFT data
+                memcpy(fftPoints, d_fft->get_outbuf(), sizeof(gr_complex)*d_fftsize);
+                fftSize = d_fftsize;
+                return;
+            }
         }
 
-        // perform FFT
-        do_fft(d_cbuf.linearize(), d_cbuf.size());  // FIXME: array_one() and two() may be faster
-        d_cbuf.clear();
+        // not enough new samples in the buffer
+        fftSize = 0;
+    }
+
+    void fft_c_impl::get_psd_data(float* psd, int &fftSize)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
 
-        // get FFT data
-        memcpy(fftPoints, d_fft->get_outbuf(), sizeof(gr_complex)*d_fftsize);
+        if (d_psd_count == 0)
+        {
+            fftSize = 0;
+            return;
+        }
+
+        // average and normalize like the single FFT, then start over
+        float scale = 1.0f / ((float)d_fftsize * (float)d_fftsize * (float)d_psd_count);
+        for (int i = 0; i < d_fftsize; i++)
+        {
+            psd[i] = d_psd_acc[i] * scale;
+            d_psd_acc[i] = 0.0f;
+        }
+        d_psd_count = 0;
         fftSize = d_fftsize;
     }
 
-    /*! \brief Compute FFT on the available input data.
-     *  \param data_in The data to compute FFT on.
-     *  \param size The size of data_in.
+    bool fft_c_impl::wait_psd_data(int timeout_ms)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeout_ms);
+
+        while (d_psd_count == 0)
+        {
+            if (!d_psd_ready.timed_wait(lock, deadline))
+                break;
+        }
+
+        return d_psd_count > 0;
+    }
+
+    void fft_c_impl::set_averaging(bool enable)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        if (enable && !d_averaging)
+            restart_averaging();
+        d_averaging = enable;
+    }
+
+    bool fft_c_impl::get_averaging()
+    {
+        return d_averaging;
+    }
+
+    /*! \brief Averaging thread.
      *
-     * Note that this function does not lock the mutex since the caller, get_fft_data()
-     * has alrady locked it.
+     * Transforms every segment of the stream as soon as it is available and
+     * sleeps when it has caught up. At 4 Msps a 4000 point FFT advances by
+     * half a millisecond per segment, so a 1 ms nap costs nothing but a
+     * slightly later result.
      */
-    void fft_c_impl::do_fft(const gr_complex *data_in, int size)
+    void fft_c_impl::welch_thread()
     {
-        // apply window, then execute FFT
-        if (d_window.size())
+        try
         {
-            gr_complex *dst = d_fft->get_inbuf();
-            for (int i = 0; i < size; i++)
-                dst[i] = data_in[i] * d_window[i];
+            for (;;)
+            {
+                boost::this_thread::interruption_point();
+
+                if (!welch_segment())
+                    boost::this_thread::sleep(boost::posix_time::milliseconds(d_averaging ? 1 : 20));
+            }
         }
-        else
+        catch (boost::thread_interrupted&)
+        {
+        }
+    }
+
+    /*! \brief Transform and accumulate the next segment.
+     *  \returns False if there was nothing to do.
+     */
+    bool fft_c_impl::welch_segment()
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+        uint64_t w = __atomic_load_n(&d_written, __ATOMIC_ACQUIRE);
+
+        if (!d_averaging || (d_fft == NULL))
+            return false;
+
+        if (d_decim > 1)
+            return zoom_segment(w);
+
+        if (w < d_seg_pos + d_fftsize)
+            return false;
+
+        // fallen too far behind, skip to the latest samples
+        if (w - d_seg_pos > (uint64_t)(FFT_RING_SIZE - 2 * d_fftsize))
+            d_seg_pos = w - d_fftsize;
+
+        if (read_ring(d_fft->get_inbuf(), d_seg_pos, d_fftsize, true))
+        {
+            d_fft->execute();
+            accumulate();
+        }
+
+        // 50% overlap
+        d_seg_pos += d_fftsize / 2;
+
+        return true;
+    }
+
+    /*! \brief Shift, decimate and accumulate the next block in zoom mode.
+     *  \param w Number of samples written to the ring.
+     *  \returns False if there was nothing to do.
+     *
+     * The samples are consumed in blocks of at most ZOOM_CHUNK. The decimated
+     * samples are collected until there is a full segment, which is then
+     * transformed like in full band mode. Called by welch_segment() with the
+     * mutex held.
+     */
+    bool fft_c_impl::zoom_segment(uint64_t w)
+    {
+        int ntaps = d_zoom_filter->ntaps();
+        int n, nout;
+
+        // fallen too far behind, start over with the latest samples
+        if (w - d_seg_pos > (uint64_t)(FFT_RING_SIZE - ZOOM_CHUNK))
+        {
+            d_seg_pos = w - ZOOM_CHUNK;
+            d_zoom_in_len = 0;
+            d_zoom_len = 0;
+        }
+
+        // shift the zoom center to 0 Hz
+        n = (int)std::min(w - d_seg_pos, (uint64_t)(d_zoom_in.size() - d_zoom_in_len));
+        if (n > 0)
+        {
+            gr_complex *dst = &d_zoom_in[d_zoom_in_len];
+
+            if (!read_ring(dst, d_seg_pos, n, false))
+            {
+                // overwritten while copying, the stream is broken anyway
+                d_seg_pos = w;
+                d_zoom_in_len = 0;
+                d_zoom_len = 0;
+                return true;
+            }
+
+            d_zoom_rot.rotateN(dst, dst, n);
+            d_zoom_in_len += n;
+            d_seg_pos += n;
+        }
+
+        // decimate into the segment, keeping the filter history
+        nout = std::min((d_zoom_in_len - ntaps + 1) / d_decim, d_fftsize - d_zoom_len);
+        if (nout > 0)
         {
-            memcpy(d_fft->get_inbuf(), data_in, sizeof(gr_complex)*size);
+            d_zoom_filter->filterNdec(&d_zoom_out[d_zoom_len], &d_zoom_in[0], nout, d_decim);
+            d_zoom_len += nout;
+            d_zoom_in_len -= nout * d_decim;
+            memmove(&d_zoom_in[0], &d_zoom_in[nout * d_decim], sizeof(gr_complex) * d_zoom_in_len);
         }
 
-        d_fft->execute();
+        if (d_zoom_len == d_fftsize)
+        {
+            copy_window(d_fft->get_inbuf(), &d_zoom_out[0], d_window, d_fftsize);
+            d_fft->execute();
+            accumulate();
+
+            // 50% overlap
+            d_zoom_len = d_fftsize - d_fftsize / 2;
+            memmove(&d_zoom_out[0], &d_zoom_out[d_fftsize / 2], sizeof(gr_complex) * d_zoom_len);
+        }
+
+        return (n > 0) || (nout > 0);
+    }
+
+    /*! \brief Add the power of the FFT output to the averages.
+     *
+     * Called with the mutex held.
+     */
+    void fft_c_impl::accumulate()
+    {
+        const gr_complex *out = d_fft->get_outbuf();
+
+        for (int i = 0; i < d_fftsize; i++)
+            d_psd_acc[i] += out[i].real() * out[i].real() + out[i].imag() * out[i].imag();
+
+        // a new frame is ready
+        if (++d_psd_count == 1)
+            d_psd_ready.notify_all();
+    }
+
+    /*! \brief Discard the averages and start over with the samples arriving from now on.
+     *
+     * Called with the mutex held.
+     */
+    void fft_c_impl::restart_averaging()
+    {
+        d_seg_pos = __atomic_load_n(&d_written, __ATOMIC_ACQUIRE);
+        d_psd_acc.assign(d_fftsize, 0.0f);
+        d_psd_count = 0;
+        d_zoom_in_len = 0;
+        d_zoom_len = 0;
     }
 
     void fft_c_impl::set_fft_size(int fftsize)
     {
-        if (fftsize != d_fftsize)
+        boost::mutex::scoped_lock lock(d_plan_mutex);
+        std::map<int, gr::fft::fft_complex*>::iterator it;
+
+        if (fftsize > MAX_FFT_SIZE)
+            fftsize = MAX_FFT_SIZE;
+        else if (fftsize < 2)
+            fftsize = 2;
+
+        it = d_plans.find(fftsize);
+        if (it != d_plans.end())
+        {
+            // plan already built, switch now
+            d_plan_size = 0;
+            apply_plan(it->second);
+        }
+        else
+        {
+            d_plan_size = fftsize;
+            d_plan_queue.push_back(fftsize);
+            d_plan_cond.notify_one();
+        }
+    }
+
+    void fft_c_impl::prepare_fft_sizes(const std::vector<int> &sizes)
+    {
+        boost::mutex::scoped_lock lock(d_plan_mutex);
+
+        for (unsigned int i = 0; i < sizes.size(); i++)
+        {
+            if ((sizes[i] >= 2) && (sizes[i] <= MAX_FFT_SIZE))
+                d_plan_queue.push_back(sizes[i]);
+        }
+        d_plan_cond.notify_one();
+    }
+
+    int fft_c::fftw_size(int fftsize)
+    {
+        static const int primes[] = { 2, 3, 5, 7 };
+        int n, m, i;
+
+        for (n = std::max(fftsize, 1); ; n++)
+        {
+            m = n;
+            for (i = 0; i < 4; i++)
+                while (m % primes[i] == 0)
+                    m /= primes[i];
+
+            if (m == 1)
+                return n;
+        }
+    }
+
+    /*! \brief Switch to a new FFT plan.
+     *  \param plan The plan, which determines the new FFT size.
+     *
+     * Called with d_plan_mutex held.
+     */
+    void fft_c_impl::apply_plan(gr::fft::fft_complex *plan)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        if (plan == d_fft)
+            return;
+
+        d_fft = plan;
+        d_fftsize = plan->inbuf_length();
+
+        // restart averaging and wait for a full set of new samples
+        restart_averaging();
+        d_last_read = d_seg_pos;
+
+        // recalculate window for the new size
+        make_window(d_wintype);
+    }
+
+    /*! \brief Planner thread.
+     *
+     * Builds the FFT plans for the queued sizes, one at a time, and switches
+     * to the one requested by set_fft_size() when it is ready. Plans are kept
+     * until the block is destroyed, so switching back and forth is free.
+     *
+     * The FFTW plans are measured, which is slow unless the FFTW wisdom
+     * already knows the size; fft_complex loads the wisdom from and saves it
+     * to ~/.gr_fftw_wisdom around each plan, so each size is only measured
+     * once per machine. None of this happens with d_mutex held, so the FFT
+     * data keeps flowing at the old size meanwhile.
+     */
+    void fft_c_impl::planner_thread()
+    {
+        gr::fft::fft_complex *plan;
+        int size;
+
+        try
         {
-            boost::mutex::scoped_lock lock(d_mutex);
+            for (;;)
+            {
+                {
+                    boost::mutex::scoped_lock lock(d_plan_mutex);
+
+                    while (d_plan_queue.empty())
+                        d_plan_cond.wait(lock);
 
-            d_fftsize = fftsize;
+                    size = d_plan_queue.front();
+                    d_plan_queue.erase(d_plan_queue.begin());
+                    if (d_plans.count(size))
+                        plan = d_plans[size];
+                    else
+                        plan = NULL;
+                }
 
-            // clear and resize circular buffer
-            d_cbuf.clear();
-            d_cbuf.set_capacity(d_fftsize);
+                if (plan == NULL)
+                    plan = new gr::fft::fft_complex(size, true, 1);
 
-            // reset window
-            d_wintype = -1;
-            set_window_type(d_wintype);
+                boost::mutex::scoped_lock lock(d_plan_mutex);
 
-            // reset FFT object (also reset FFTW plan)
-            delete d_fft;
-            d_fft = new gr::fft::fft_complex(d_fftsize, true);
+                d_plans[size] = plan;
+                if (size == d_plan_size)
+                {
+                    d_plan_size = 0;
+                    apply_plan(plan);
+                }
+            }
+        }
+        catch (boost::thread_interrupted&)
+        {
         }
     }
 
@@ -149,12 +560,29 @@ namespace strx {
 
     void fft_c_impl::set_window_type(int wintype)
     {
+        boost::mutex::scoped_lock lock(d_mutex);
+
         if (wintype == d_wintype)
         {
             // nothing to do
             return;
         }
 
+        make_window(wintype);
+
+        // segments with different windows should not be averaged
+        restart_averaging();
+    }
+
+    /*! \brief Calculate the window taps for the current FFT size.
+     *  \param wintype The window type, see gnuradio/filter/firdes.h
+     *
+     * Called with the mutex held (or from the constructor).
+     */
+    void fft_c_impl::make_window(int wintype)
+    {
+        std::vector<float> taps;
+
         d_wintype = wintype;
 
         if ((d_wintype < gr::filter::firdes::WIN_HAMMING) || (d_wintype > gr::filter::firdes::WIN_BLACKMAN_hARRIS))
@@ -162,8 +590,12 @@ namespace strx {
             d_wintype = gr::filter::firdes::WIN_HAMMING;
         }
 
-        d_window.clear();
-        d_window = gr::filter::firdes::window((gr::filter::firdes::win_type)d_wintype, d_fftsize, 6.76);
+        taps = gr::filter::firdes::window((gr::filter::firdes::win_type)d_wintype, d_fftsize, 6.76);
+        for (int i = 0; i < d_fftsize; i++)
+        {
+            d_window[2 * i] = taps[i];
+            d_window[2 * i + 1] = taps[i];
+        }
     }
 
     int fft_c_impl::get_window_type()
@@ -171,4 +603,44 @@ namespace strx {
         return d_wintype;
     }
 
+    void fft_c_impl::set_zoom(int decim, double center)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        if (decim < 1)
+            decim = 1;
+        else if (decim > MAX_FFT_ZOOM)
+            decim = MAX_FFT_ZOOM;
+
+        // the center does not matter for the full band
+        if ((decim == d_decim) && ((decim == 1) || (center == d_zoom_center)))
+            return;
+
+        if (decim != d_decim)
+        {
+            delete d_zoom_filter;
+            d_zoom_filter = NULL;
+
+            if (decim > 1)
+            {
+                // flat over 80% of the zoomed span, aliases only reach the outer 20%
+                std::vector<float> taps = gr::filter::firdes::low_pass(1.0, 1.0, 0.5 / decim, 0.2 / decim);
+
+                d_zoom_filter = new gr::filter::kernel::fir_filter_ccf(decim, taps);
+                d_zoom_in.resize(ZOOM_CHUNK + taps.size());
+            }
+        }
+
+        d_decim = decim;
+        d_zoom_center = center;
+        d_zoom_rot.set_phase_incr(std::polar(1.0f, (float)(-2.0 * M_PI * center)));
+
+        restart_averaging();
+    }
+
+    int fft_c_impl::get_zoom()
+    {
+        return d_decim;
+    }
+
 } // namespace strx
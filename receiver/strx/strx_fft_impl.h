@@ -20,15 +20,27 @@
 #ifndef INCLUDED_STRX_FFT_IMPL_H
 #define INCLUDED_STRX_FFT_IMPL_H
 
+#include <stdint.h>
+#include <map>
+#include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
-#include <boost/circular_buffer.hpp>
+#include <gnuradio/blocks/rotator.h>
 #include <gnuradio/config.h>
 #include <gnuradio/fft/fft.h>
+#include <gnuradio/filter/fir_filter.h>
 #include <gnuradio/filter/firdes.h>
 #include <gnuradio/gr_complex.h>
 
 #include "strx_fft.h"
 
+/*! Size of the sample ring, a power of two. The Welch worker may lag up to
+ *  FFT_RING_SIZE - 2 FFTs behind work(), which must leave room to step
+ *  through the overlapping segments even at MAX_FFT_SIZE. */
+#define FFT_RING_SIZE (4*MAX_FFT_SIZE)
+
+/*! Number of samples mixed and decimated per pass in zoom mode. */
+#define ZOOM_CHUNK 8192
+
 namespace strx {
 
     class fft_c_impl : public fft_c
@@ -43,20 +55,68 @@ namespace strx {
 
         // Public API functions documented in strx_fft.h
         void get_fft_data(std::complex<float>* fft_points, int &fft_size);
+        void get_psd_data(float* psd, int &fft_size);
+        bool wait_psd_data(int timeout_ms);
+        void set_averaging(bool enable);
+        bool get_averaging();
         void set_window_type(int wintype);
         int  get_window_type();
         void set_fft_size(int fftsize);
         int get_fft_size();
+        void prepare_fft_sizes(const std::vector<int> &sizes);
+        void set_zoom(int decim, double center);
+        int get_zoom();
 
     private:
         int           d_fftsize;   /*! Current FFT size. */
         int           d_wintype;   /*! Current window type. */
-        boost::mutex  d_mutex;     /*! Used to lock FFT output buffer. */
-        gr::fft::fft_complex *d_fft;    /*! FFT object. */
-        std::vector<float>   d_window; /*! FFT window taps. */
-        boost::circular_buffer<gr_complex> d_cbuf; /*! buffer to accumulate samples. */
+        boost::mutex  d_mutex;     /*! Protects the FFT object, window and averages; never taken by work(). */
+        gr::fft::fft_complex *d_fft;    /*! FFT object, NULL until the first plan is ready. */
+        float        *d_window;    /*! FFT window, each tap twice (for I and Q), cache line aligned. */
+
+        /* Lock-free sample ring. work() is the only writer; the readers,
+         * get_fft_data() and the averaging thread, synchronize with it
+         * through the two counters alone. */
+        gr_complex   *d_ring;       /*! Sample ring, FFT_RING_SIZE samples. */
+        uint64_t      d_writing;    /*! Samples written once the current work() call is done. */
+        uint64_t      d_written;    /*! Samples written and published to the reader. */
+        uint64_t      d_last_read;  /*! Value of d_written at the last FFT (reader side). */
+
+        // Welch averaging
+        boost::thread       d_thread;    /*! Averaging thread. */
+        bool                d_averaging; /*! Averaging enabled. */
+        uint64_t            d_seg_pos;   /*! Sample number of the next segment. */
+        std::vector<float>  d_psd_acc;   /*! Accumulated |X|^2 per bin. */
+        int                 d_psd_count; /*! Number of accumulated segments. */
+        boost::condition_variable d_psd_ready; /*! Signalled when the first segment is accumulated. */
+
+        // FFT plans, built by the planner thread
+        boost::thread       d_planner;    /*! Planner thread. */
+        boost::mutex        d_plan_mutex; /*! Protects the plans and the queue; taken before d_mutex. */
+        boost::condition_variable d_plan_cond; /*! Signalled when a size is queued. */
+        std::map<int, gr::fft::fft_complex*> d_plans; /*! Plans by FFT size. */
+        std::vector<int>    d_plan_queue; /*! Sizes waiting for a plan. */
+        int                 d_plan_size;  /*! Size to switch to when its plan is ready, 0 if none. */
+
+        // Zoom
+        int                 d_decim;       /*! Zoom decimation, 1 when zoom is off. */
+        double              d_zoom_center; /*! Zoom center relative to the sample rate. */
+        gr::blocks::rotator d_zoom_rot;    /*! Shifts the zoom center to 0 Hz. */
+        gr::filter::kernel::fir_filter_ccf *d_zoom_filter; /*! Anti-alias filter and decimator. */
+        std::vector<gr_complex> d_zoom_in; /*! Shifted samples waiting for the decimator. */
+        int                 d_zoom_in_len; /*! Number of samples in d_zoom_in. */
+        std::vector<gr_complex> d_zoom_out; /*! Decimated samples of the next segment. */
+        int                 d_zoom_len;    /*! Number of samples in d_zoom_out. */
 
-        void do_fft(const gr_complex *data_in, int size);
+        bool read_ring(gr_complex *dst, uint64_t start, int size, bool window);
+        void make_window(int wintype);
+        void accumulate();
+        void restart_averaging();
+        void apply_plan(gr::fft::fft_complex *plan);
+        void planner_thread();
+        void welch_thread();
+        bool welch_segment();
+        bool zoom_segment(uint64_t w);
     };
 
 } // namespace strx
@@ -0,0 +1,119 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GNU Radio; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef INCLUDED_STRX_FILE_SOURCE_C_H
+#define INCLUDED_STRX_FILE_SOURCE_C_H
+
+#include <stdint.h>
+#include <gnuradio/sync_block.h>
+
+#include "strx_api.h"
+
+
+namespace strx {
+
+    /*! \brief Strx I/Q file source.
+     *
+     * Replays an I/Q file recorded by the receiver, in any of the formats in
+     * strx_iq_format.h; SC16 and SC8 files are recognized by their block
+     * headers and converted back to complex float. The file is mapped into
+     * memory one window at a time, so files of any size can be replayed and
+     * seeking is instant.
+     *
+     * The replay is paced by the block itself: the number of samples produced
+     * since the last seek or speed change is compared with the wall clock and
+     * the block sleeps until the samples are due. The average rate is thus
+     * exact, and a speed of 0 replays as fast as the flow graph can take it.
+     *
+     * The replay covers a region of the file, by default the whole file. At
+     * the end of the region the source either loops back to its beginning or
+     * finishes the flow graph.
+     *
+     * If the recording has an index file, times are mapped to samples by
+     * looking up the index, so that seeks by time stay correct across the
+     * gaps left by dropped samples. The records are written at a fixed
+     * period, which makes the lookup a direct computation rather than a
+     * search. Without an index the sample rate is used.
+     */
+    class STRX_API file_source_c : virtual public gr::sync_block
+    {
+    public:
+
+        typedef boost::shared_ptr<file_source_c> sptr;
+
+        /*! \brief Return a shared_ptr to a new instance of strx::file_source_c.
+         *  \param filename The I/Q file.
+         *  \param samp_rate The sample rate of the file.
+         *  \param loop Whether to loop over the file or stop at its end.
+         *
+         * Throws std::runtime_error if the file can not be opened.
+         */
+        static sptr make(const std::string &filename, double samp_rate, bool loop=true);
+
+        /*! \brief Seek to a sample.
+         *  \param sample The number of the sample to continue with, counted from
+         *                the beginning of the file and clamped to the region.
+         */
+        virtual void seek(uint64_t sample) = 0;
+
+        /*! \brief Get the number of the next sample. */
+        virtual uint64_t tell() = 0;
+
+        /*! \brief Get the number of samples in the file. */
+        virtual uint64_t nitems_total() = 0;
+
+        /*! \brief Set replay speed.
+         *  \param speed The replay speed relative to real time, 0 for unthrottled.
+         */
+        virtual void set_speed(double speed) = 0;
+
+        /*! \brief Get the current replay speed. */
+        virtual double speed() = 0;
+
+        /*! \brief Set replay region.
+         *  \param start The first sample of the region.
+         *  \param stop The sample following the region, 0 for the end of the file.
+         *  \param loop Whether to loop over the region or stop at its end.
+         *
+         * The replay continues at the start of the new region.
+         */
+        virtual void set_region(uint64_t start, uint64_t stop, bool loop) = 0;
+
+        /*! \brief Convert a time to a sample.
+         *  \param seconds The time since the first sample of the recording.
+         *  \returns The number of the sample recorded at that time or, if it
+         *           falls into a gap, the first sample after the gap.
+         */
+        virtual uint64_t time_to_sample(double seconds) = 0;
+
+        /*! \brief Convert a sample to a time.
+         *  \param sample The number of the sample.
+         *  \returns The time since the first sample of the recording in seconds.
+         */
+        virtual double sample_to_time(uint64_t sample) = 0;
+
+        /*! \brief Get the wall clock time of the first sample.
+         *  \returns The time in ns since the epoch (UTC) or 0 without an index.
+         */
+        virtual int64_t start_time_ns() = 0;
+    };
+
+} // namespace strx
+
+#endif /* INCLUDED_STRX_FILE_SOURCE_C_H */
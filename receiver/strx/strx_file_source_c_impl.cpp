@@ -0,0 +1,414 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GNU Radio; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <boost/thread/thread.hpp>
+#include <gnuradio/io_signature.h>
+#include "strx_file_source_c_impl.h"
+
+namespace strx {
+
+    file_source_c::sptr file_source_c::make(const std::string &filename, double samp_rate, bool loop)
+    {
+        return gnuradio::get_initial_sptr(new file_source_c_impl(filename, samp_rate, loop));
+    }
+
+    file_source_c_impl::file_source_c_impl(const std::string &filename, double samp_rate, bool loop)
+      : gr::sync_block("strx_file_source_c",
+                       gr::io_signature::make(0, 0, 0),
+                       gr::io_signature::make(1, 1, sizeof (gr_complex))),
+        d_samp_rate(samp_rate),
+        d_format(IQ_FORMAT_FC32),
+        d_block_items(0),
+        d_index_period(0),
+        d_index_t0(0),
+        d_map(NULL),
+        d_map_offs(0),
+        d_map_len(0),
+        d_pos(0),
+        d_start(0),
+        d_loop(loop),
+        d_speed(1.0),
+        d_count(0)
+    {
+        struct stat st;
+        iq_block_header hdr;
+
+        d_fd = open(filename.c_str(), O_RDONLY);
+        if (d_fd < 0)
+            throw std::runtime_error("can't open " + filename + ": " + strerror(errno));
+
+        if (fstat(d_fd, &st) < 0 || st.st_size < (off_t)sizeof(gr_complex))
+        {
+            close(d_fd);
+            throw std::runtime_error("no I/Q samples in " + filename);
+        }
+        d_file_size = st.st_size;
+        d_nitems = d_file_size / sizeof(gr_complex);
+
+        // SC16/SC8 files start with a block header, anything else is FC32
+        if (d_file_size >= IQ_BLOCK_SIZE &&
+            pread(d_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && iq_block_valid(&hdr))
+        {
+            uint64_t nblocks = d_file_size / IQ_BLOCK_SIZE;
+
+            d_format = hdr.format;
+            d_block_items = iq_block_items(d_format);
+            if (fabs(hdr.rate - d_samp_rate) > 1.0)
+                std::cerr << filename << " was recorded at " << hdr.rate
+                          << " samples/s but is replayed at " << d_samp_rate << std::endl;
+
+            // only the last block may be partial
+            d_nitems = (nblocks - 1) * d_block_items;
+            if (pread(d_fd, &hdr, sizeof(hdr), (nblocks - 1) * IQ_BLOCK_SIZE) == sizeof(hdr) &&
+                iq_block_valid(&hdr))
+                d_nitems += hdr.nitems;
+            else
+                d_nitems += d_block_items;
+        }
+        d_stop = d_nitems;
+
+        load_index(iq_sidecar_name(filename, ".idx"));
+        restart_clock();
+    }
+
+    file_source_c_impl::~file_source_c_impl()
+    {
+        if (d_map)
+            munmap(d_map, d_map_len);
+        close(d_fd);
+    }
+
+    /*! \brief Load the index file of the recording, if there is one.
+     *
+     * The index is small, one record per period, so it is read in full. A
+     * missing or unusable index is not an error; the sample rate is used
+     * for time conversions instead.
+     */
+    void file_source_c_impl::load_index(const std::string &filename)
+    {
+        iq_index_header hdr;
+        iq_index_record rec;
+        FILE *fp;
+
+        fp = fopen(filename.c_str(), "rb");
+        if (fp == NULL)
+            return;
+
+        if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+            memcmp(hdr.magic, IQ_INDEX_MAGIC, 4) != 0 ||
+            hdr.version != IQ_INDEX_VERSION ||
+            hdr.rec_len != sizeof(iq_index_record) ||
+            hdr.period_ms == 0)
+        {
+            std::cerr << "Ignoring invalid index " << filename << std::endl;
+            fclose(fp);
+            return;
+        }
+
+        // a recording cut short may end with a partial record
+        while (fread(&rec, sizeof(rec), 1, fp) == 1)
+        {
+            if (rec.offset > d_nitems)
+                break;
+            if (!d_index.empty() && (rec.offset < d_index.back().offset ||
+                                     rec.time_ns < d_index.back().time_ns))
+                break;
+            d_index.push_back(rec);
+        }
+        fclose(fp);
+
+        if (d_index.empty())
+            return;
+
+        d_index_period = (int64_t)hdr.period_ms * 1000000;
+        d_index_t0 = d_index[0].time_ns - (int64_t)(d_index[0].offset * 1.e9 / d_samp_rate);
+
+        std::cerr << "Loaded " << d_index.size() << " records from " << filename << std::endl;
+    }
+
+    /*! \brief Map the file window holding a file offset.
+     *  \param offs The file offset in bytes.
+     *  \param len The number of bytes wanted, returns the number available in
+     *              the window.
+     *  \returns Pointer to the data at the offset.
+     *
+     * The windows are aligned to FILE_MAP_SIZE, which is a multiple of the
+     * page size, the FC32 sample size and the SC16/SC8 block size, so neither
+     * a sample nor a block ever straddles two windows. Must be called with
+     * d_mutex held.
+     */
+    const char *file_source_c_impl::map_file(uint64_t offs, size_t &len)
+    {
+        if (d_map == NULL || offs < d_map_offs || offs >= d_map_offs + d_map_len)
+        {
+            if (d_map)
+                munmap(d_map, d_map_len);
+
+            d_map_offs = offs & ~(uint64_t)(FILE_MAP_SIZE - 1);
+            d_map_len = std::min((uint64_t)FILE_MAP_SIZE, d_file_size - d_map_offs);
+            d_map = (char *)mmap(NULL, d_map_len, PROT_READ, MAP_SHARED, d_fd, d_map_offs);
+            if (d_map == MAP_FAILED)
+            {
+                d_map = NULL;
+                throw std::runtime_error(std::string("can't map I/Q file: ") + strerror(errno));
+            }
+
+            // read ahead aggressively and start fetching right away, also after a seek
+            size_t skip = (offs - d_map_offs) & ~(uint64_t)(getpagesize() - 1);
+            madvise(d_map, d_map_len, MADV_SEQUENTIAL);
+            madvise(d_map + skip, d_map_len - skip, MADV_WILLNEED);
+        }
+
+        len = std::min((uint64_t)len, d_map_offs + d_map_len - offs);
+
+        return d_map + (offs - d_map_offs);
+    }
+
+    /*! \brief Read samples from the file and convert them to complex float.
+     *  \param out The output buffer.
+     *  \param pos The number of the first sample.
+     *  \param nitems The number of samples wanted.
+     *  \returns The number of samples read, at least 1.
+     *
+     * Must be called with d_mutex held.
+     */
+    int file_source_c_impl::read_samples(gr_complex *out, uint64_t pos, int nitems)
+    {
+        size_t len;
+
+        if (d_format == IQ_FORMAT_FC32)
+        {
+            len = nitems * sizeof(gr_complex);
+            const char *src = map_file(pos * sizeof(gr_complex), len);
+            nitems = len / sizeof(gr_complex);
+            memcpy(out, src, nitems * sizeof(gr_complex));
+
+            return nitems;
+        }
+
+        uint64_t block = pos / d_block_items;
+        int first = pos % d_block_items;
+        float *dst = (float *)out;
+
+        len = IQ_BLOCK_SIZE;
+        const iq_block_header *hdr = (const iq_block_header *)map_file(block * IQ_BLOCK_SIZE, len);
+
+        if (!iq_block_valid(hdr) || hdr->format != d_format || (int)hdr->nitems <= first)
+        {
+            // damaged block, replay silence rather than garbage
+            nitems = std::min(nitems, d_block_items - first);
+            std::fill(out, out + nitems, gr_complex(0.f, 0.f));
+
+            return nitems;
+        }
+
+        nitems = std::min(nitems, (int)hdr->nitems - first);
+        if (d_format == IQ_FORMAT_SC16)
+        {
+            const int16_t *src = (const int16_t *)(hdr + 1) + 2 * first;
+            for (int i = 0; i < 2 * nitems; i++)
+                dst[i] = src[i] * hdr->scale;
+        }
+        else
+        {
+            const int8_t *src = (const int8_t *)(hdr + 1) + 2 * first;
+            for (int i = 0; i < 2 * nitems; i++)
+                dst[i] = src[i] * hdr->scale;
+        }
+
+        return nitems;
+    }
+
+    /*! \brief Restart pacing from the current time. Must be called with d_mutex held. */
+    void file_source_c_impl::restart_clock()
+    {
+        d_t0 = boost::get_system_time();
+        d_count = 0;
+    }
+
+    int file_source_c_impl::work(int noutput_items,
+                                 gr_vector_const_void_star &input_items,
+                                 gr_vector_void_star &output_items)
+    {
+        gr_complex *out = (gr_complex *) output_items[0];
+        boost::system_time due;
+        bool paced;
+        int nitems = 0;
+        int n;
+
+        (void) input_items;
+
+        {
+            boost::mutex::scoped_lock lock(d_mutex);
+
+            // keep each call short, so that seeks and speed changes are quick
+            paced = d_speed > 0.0;
+            if (paced)
+                noutput_items = std::min(noutput_items,
+                                         std::max(1, (int)(d_samp_rate * d_speed / FILE_PACE_RATE)));
+
+            while (nitems < noutput_items)
+            {
+                if (d_pos >= d_stop)
+                {
+                    if (!d_loop)
+                        break;
+                    d_pos = d_start;
+                }
+
+                n = (int)std::min((uint64_t)(noutput_items - nitems), d_stop - d_pos);
+                n = read_samples(out + nitems, d_pos, n);
+                nitems += n;
+                d_pos += n;
+            }
+
+            if (nitems == 0)
+                return WORK_DONE;
+
+            d_count += nitems;
+            if (paced)
+                due = d_t0 + boost::posix_time::microseconds(
+                          (int64_t)(d_count * 1.e6 / (d_samp_rate * d_speed)));
+        }
+
+        // sleep without the lock, seek() and set_speed() restart the clock anyway
+        if (paced)
+            boost::this_thread::sleep(due);
+
+        return nitems;
+    }
+
+    void file_source_c_impl::seek(uint64_t sample)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        d_pos = std::min(std::max(sample, d_start), d_stop - 1);
+        restart_clock();
+    }
+
+    uint64_t file_source_c_impl::tell()
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        return d_pos;
+    }
+
+    uint64_t file_source_c_impl::nitems_total()
+    {
+        return d_nitems;
+    }
+
+    void file_source_c_impl::set_speed(double speed)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        d_speed = std::max(speed, 0.0);
+        restart_clock();
+    }
+
+    double file_source_c_impl::speed()
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        return d_speed;
+    }
+
+    void file_source_c_impl::set_region(uint64_t start, uint64_t stop, bool loop)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        if (stop == 0 || stop > d_nitems)
+            stop = d_nitems;
+        if (start >= stop)
+            start = stop - 1;
+
+        d_start = start;
+        d_stop = stop;
+        d_loop = loop;
+        d_pos = start;
+        restart_clock();
+    }
+
+    uint64_t file_source_c_impl::time_to_sample(double seconds)
+    {
+        size_t n = d_index.size();
+        size_t i;
+        int64_t t;
+        double sample;
+
+        if (n == 0)
+            return (uint64_t)(std::max(seconds, 0.0) * d_samp_rate);
+
+        t = d_index_t0 + (int64_t)(seconds * 1.e9);
+
+        // the records are periodic, so the first guess is usually right and
+        // only a gap or jitter in the recording makes us step a record or two
+        if (t <= d_index[0].time_ns)
+            i = 0;
+        else
+            i = std::min((size_t)((t - d_index[0].time_ns) / d_index_period), n - 1);
+        while (i + 1 < n && d_index[i + 1].time_ns <= t)
+            i++;
+        while (i > 0 && d_index[i].time_ns > t)
+            i--;
+
+        sample = d_index[i].offset + (t - d_index[i].time_ns) * 1.e-9 * d_samp_rate;
+        if (i + 1 < n)
+            sample = std::min(sample, (double)d_index[i + 1].offset);
+
+        return (uint64_t)std::max(sample, 0.0);
+    }
+
+    double file_source_c_impl::sample_to_time(uint64_t sample)
+    {
+        size_t n = d_index.size();
+        size_t i;
+
+        if (n == 0)
+            return sample / d_samp_rate;
+
+        // last record at or before the sample, guessed the same way
+        i = std::min((size_t)(sample / (d_index_period * 1.e-9 * d_samp_rate)), n - 1);
+        while (i + 1 < n && d_index[i + 1].offset <= sample)
+            i++;
+        while (i > 0 && d_index[i].offset > sample)
+            i--;
+
+        return (d_index[i].time_ns - d_index_t0) * 1.e-9 +
+               ((double)sample - (double)d_index[i].offset) / d_samp_rate;
+    }
+
+    int64_t file_source_c_impl::start_time_ns()
+    {
+        return d_index_t0;
+    }
+
+} // namespace strx
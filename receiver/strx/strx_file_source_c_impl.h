@@ -0,0 +1,96 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GNU Radio; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef INCLUDED_STRX_FILE_SOURCE_C_IMPL_H
+#define INCLUDED_STRX_FILE_SOURCE_C_IMPL_H
+
+#include <stdint.h>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <gnuradio/gr_complex.h>
+
+#include "strx_file_source_c.h"
+#include "strx_iq_format.h"
+
+/*! Size of the file window mapped at a time, a power of two and a multiple of IQ_BLOCK_SIZE. */
+#define FILE_MAP_SIZE (64 << 20)
+
+/*! Pacing steps per second; each call to work() covers at most one step. */
+#define FILE_PACE_RATE 100
+
+namespace strx {
+
+    class file_source_c_impl : public file_source_c
+    {
+    public:
+        file_source_c_impl(const std::string &filename, double samp_rate, bool loop);
+        ~file_source_c_impl();
+
+        int work(int noutput_items,
+                 gr_vector_const_void_star &input_items,
+                 gr_vector_void_star &output_items);
+
+        // Public API functions documented in strx_file_source_c.h
+        void seek(uint64_t sample);
+        uint64_t tell();
+        uint64_t nitems_total();
+        void set_speed(double speed);
+        double speed();
+        void set_region(uint64_t start, uint64_t stop, bool loop);
+        uint64_t time_to_sample(double seconds);
+        double sample_to_time(uint64_t sample);
+        int64_t start_time_ns();
+
+    private:
+        void load_index(const std::string &filename);
+        const char *map_file(uint64_t offs, size_t &len);
+        int read_samples(gr_complex *out, uint64_t pos, int nitems);
+        void restart_clock();
+
+        int           d_fd;         /*! File descriptor of the I/Q file. */
+        uint64_t      d_file_size;  /*! Size of the file in bytes. */
+        uint64_t      d_nitems;     /*! Number of samples in the file. */
+        double        d_samp_rate;
+        int           d_format;     /*! File format, see strx::iq_format_e. */
+        int           d_block_items; /*! Samples per SC16/SC8 block. */
+
+        std::vector<iq_index_record> d_index; /*! Index records, empty without an index file. */
+        int64_t       d_index_period; /*! Nominal time between index records in ns. */
+        int64_t       d_index_t0;   /*! Wall clock time of sample 0 in ns. */
+
+        boost::mutex  d_mutex;      /*! Protects the position, region and pacing; held only briefly by work(). */
+
+        char         *d_map;        /*! The mapped window or NULL. */
+        uint64_t      d_map_offs;   /*! File offset of the window in bytes. */
+        size_t        d_map_len;    /*! Length of the window in bytes. */
+
+        uint64_t      d_pos;        /*! The next sample. */
+        uint64_t      d_start;      /*! First sample of the region. */
+        uint64_t      d_stop;       /*! Sample following the region. */
+        bool          d_loop;
+        double        d_speed;      /*! Replay speed, 0 for unthrottled. */
+
+        boost::system_time d_t0;    /*! Wall clock at the last seek or speed change. */
+        uint64_t      d_count;      /*! Samples produced since d_t0. */
+    };
+
+} // namespace strx
+
+#endif /* INCLUDED_STRX_FILE_SOURCE_C_IMPL_H */
@@ -0,0 +1,159 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GNU Radio; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef INCLUDED_STRX_IQ_FORMAT_H
+#define INCLUDED_STRX_IQ_FORMAT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+/*! \file
+ * \brief I/Q recording formats.
+ *
+ * FC32 files are plain complex float samples without any header.
+ *
+ * SC16 and SC8 files are a sequence of IQ_BLOCK_SIZE byte blocks, each
+ * starting with an iq_block_header followed by interleaved I and Q integers
+ * of 16 or 8 bits. Each block has its own scale factor, chosen so that the
+ * largest component of the block uses the full integer range. All blocks
+ * hold IQ_BLOCK_ITEMS() samples except the last one, which is zero padded
+ * to the full block size. All fields are in host (little endian) order.
+ *
+ * A recording can be accompanied by an index file, an iq_index_header
+ * followed by iq_index_record entries written periodically, and after
+ * dropped samples, during the recording. The index maps time to sample
+ * offsets in the recording, also across gaps, and keeps track of the
+ * receiver state. The index and the
+ * SigMF metadata share the name of the recording, see iq_sidecar_name().
+ */
+
+/*! Size of an SC16/SC8 block in bytes; divides the recorder and file source buffer sizes. */
+#define IQ_BLOCK_SIZE 65536
+
+/*! Block header magic. */
+#define IQ_BLOCK_MAGIC "SIQB"
+
+/*! Block header version. */
+#define IQ_BLOCK_VERSION 1
+
+/*! Index file magic. */
+#define IQ_INDEX_MAGIC "SIQX"
+
+/*! Index file version. */
+#define IQ_INDEX_VERSION 1
+
+namespace strx {
+
+    /*! \brief I/Q recording format. */
+    enum iq_format_e
+    {
+        IQ_FORMAT_FC32 = 0, /*!< Complex float, 8 bytes per sample, no headers. */
+        IQ_FORMAT_SC16 = 1, /*!< Complex int16 with block headers, 4 bytes per sample. */
+        IQ_FORMAT_SC8  = 2, /*!< Complex int8 with block headers, 2 bytes per sample. */
+    };
+
+    /*! \brief SC16/SC8 block header, 64 bytes. */
+    struct iq_block_header
+    {
+        char     magic[4];  /*!< IQ_BLOCK_MAGIC. */
+        uint8_t  version;   /*!< IQ_BLOCK_VERSION. */
+        uint8_t  format;    /*!< The format, IQ_FORMAT_SC16 or IQ_FORMAT_SC8. */
+        uint16_t hdr_len;   /*!< Size of the header in bytes. */
+        uint32_t nitems;    /*!< Number of samples in the block. */
+        float    scale;     /*!< Multiply the integers by this to get the sample values. */
+        uint64_t sample;    /*!< Number of the first sample, dropped samples included. Counts from the start of the recording or of the pre-trigger ring. */
+        int64_t  time_ns;   /*!< Time of the first sample in ns since the epoch (UTC). */
+        double   freq;      /*!< Center frequency in Hz. */
+        double   rate;      /*!< Sample rate in samples per second. */
+        uint8_t  reserved[16];
+    };
+
+    // fails to compile if the header is not packed as documented
+    typedef char iq_block_header_size_check[sizeof(iq_block_header) == 64 ? 1 : -1];
+
+    /*! \brief Index file header, 64 bytes. */
+    struct iq_index_header
+    {
+        char     magic[4];  /*!< IQ_INDEX_MAGIC. */
+        uint32_t version;   /*!< IQ_INDEX_VERSION. */
+        uint32_t rec_len;   /*!< Size of a record in bytes. */
+        uint32_t period_ms; /*!< Nominal time between records. */
+        double   rate;      /*!< Sample rate in samples per second. */
+        uint8_t  reserved[40];
+    };
+
+    /*! \brief Index file record, 64 bytes. */
+    struct iq_index_record
+    {
+        uint64_t offset;    /*!< Sample offset in the recording. */
+        int64_t  time_ns;   /*!< Time of that sample in ns since the epoch (UTC). */
+        double   rf_freq;   /*!< Receiver frequency (RF + LNB LO) in Hz. */
+        double   gain;      /*!< RF gain in dB. */
+        double   ch_offs[2]; /*!< Channel offsets from the center in Hz. */
+        double   snr;       /*!< SNR of the active channel in dB. */
+        int32_t  channel;   /*!< The active channel. */
+        int32_t  reserved;
+    };
+
+    typedef char iq_index_header_size_check[sizeof(iq_index_header) == 64 ? 1 : -1];
+    typedef char iq_index_record_size_check[sizeof(iq_index_record) == 64 ? 1 : -1];
+
+    /*! \brief Get the number of bytes per sample of a format. */
+    inline int iq_format_bytes(int format)
+    {
+        return format == IQ_FORMAT_SC16 ? 4 : format == IQ_FORMAT_SC8 ? 2 : 8;
+    }
+
+    /*! \brief Get the number of samples in a full SC16/SC8 block. */
+    inline int iq_block_items(int format)
+    {
+        return (IQ_BLOCK_SIZE - sizeof(iq_block_header)) / iq_format_bytes(format);
+    }
+
+    /*! \brief Check whether a buffer starts with a valid block header. */
+    inline bool iq_block_valid(const iq_block_header *hdr)
+    {
+        return memcmp(hdr->magic, IQ_BLOCK_MAGIC, 4) == 0 &&
+               hdr->version == IQ_BLOCK_VERSION &&
+               hdr->hdr_len == sizeof(iq_block_header) &&
+               (hdr->format == IQ_FORMAT_SC16 || hdr->format == IQ_FORMAT_SC8) &&
+               (int)hdr->nitems <= iq_block_items(hdr->format);
+    }
+
+    /*! \brief Get the name of a file accompanying a recording.
+     *  \param filename The name of the recording.
+     *  \param ext The extension of the file, e.g. ".idx".
+     *
+     * The extension replaces the extension of the recording, if any.
+     */
+    inline std::string iq_sidecar_name(const std::string &filename, const char *ext)
+    {
+        std::string::size_type dot = filename.rfind('.');
+        std::string::size_type slash = filename.rfind('/');
+
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+            return filename + ext;
+
+        return filename.substr(0, dot) + ext;
+    }
+
+} // namespace strx
+
+#endif /* INCLUDED_STRX_IQ_FORMAT_H */
@@ -0,0 +1,121 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GNU Radio; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef INCLUDED_STRX_IQ_RECORDER_C_H
+#define INCLUDED_STRX_IQ_RECORDER_C_H
+
+#include <stdint.h>
+#include <gnuradio/sync_block.h>
+
+#include "strx_api.h"
+#include "strx_iq_format.h"
+
+
+namespace strx {
+
+    /*! \brief Strx I/Q recorder.
+     *
+     * Records the complex I/Q samples to a file without ever waiting for the
+     * disk in the flow graph.
+     *
+     * work() only copies the samples into large page aligned buffers. Full
+     * buffers are handed to a writer thread through a lock-free single
+     * producer, single consumer queue, and the writer thread writes them
+     * with O_DIRECT, so the page cache never fills up with recorded data.
+     * When the writer falls behind and all buffers are queued, the incoming
+     * samples are dropped and counted instead of stalling the receiver.
+     *
+     * The samples are recorded as complex float, or as complex 16 or 8 bit
+     * integers in blocks with a header carrying the scale factor, time stamp
+     * and center frequency (see strx_iq_format.h).
+     *
+     * Optionally the buffers also keep the last few seconds of samples while
+     * not recording (the pre-trigger ring). A new recording then starts with
+     * the contents of the ring, so that it includes the event that made the
+     * operator or an automatic trigger start it.
+     */
+    class STRX_API iq_recorder_c : virtual public gr::sync_block
+    {
+    public:
+
+        typedef boost::shared_ptr<iq_recorder_c> sptr;
+
+        /*! \brief Return a shared_ptr to a new instance of strx::iq_recorder_c.
+         *  \param samp_rate The sample rate, stored in the block headers.
+         */
+        static sptr make(double samp_rate);
+
+        /*! \brief Start recording into a new file.
+         *  \param filename The file name.
+         *  \returns True if the file could be created.
+         *
+         * An ongoing recording is closed first.
+         */
+        virtual bool open(const std::string &filename) = 0;
+
+        /*! \brief Select the recording format.
+         *  \param format The recording format, see strx::iq_format_e.
+         *
+         * Takes effect with the next recording and clears the pre-trigger ring.
+         */
+        virtual void set_format(int format) = 0;
+
+        /*! \brief Set the length of the pre-trigger ring.
+         *  \param seconds The time kept in RAM while not recording, 0 to disable.
+         *
+         * The ring takes seconds times the sample rate times the size of a
+         * sample in the recording format of RAM. Takes effect with the next
+         * recording and clears the ring.
+         */
+        virtual void set_pretrigger(double seconds) = 0;
+
+        /*! \brief Set the center frequency stored in the block headers.
+         *  \param freq The center frequency in Hz.
+         */
+        virtual void set_center_freq(double freq) = 0;
+
+        /*! \brief Stop recording.
+         *
+         * Returns after all recorded samples have been written and the file
+         * has been closed.
+         */
+        virtual void close() = 0;
+
+        /*! \brief Get the position of the recording.
+         *  \param[out] offset The number of samples in the file before the next one.
+         *  \param[out] time_ns The time of the next sample in ns since the epoch (UTC).
+         *
+         * The time is derived from the wall clock when the recording or the
+         * pre-trigger ring started and the number of samples since then.
+         */
+        virtual void get_position(uint64_t *offset, int64_t *time_ns) = 0;
+
+        /*! \brief Check whether a recording is in progress. */
+        virtual bool is_recording() = 0;
+
+        /*! \brief Get the number of samples dropped since the recording started. */
+        virtual uint64_t dropped() = 0;
+
+        /*! \brief Get the number of samples written since the recording started. */
+        virtual uint64_t written() = 0;
+    };
+
+} // namespace strx
+
+#endif /* INCLUDED_STRX_IQ_RECORDER_C_H */
@@ -0,0 +1,500 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GNU Radio; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <new>
+#include <gnuradio/io_signature.h>
+#include "strx_iq_recorder_c_impl.h"
+
+namespace strx {
+
+    iq_recorder_c::sptr iq_recorder_c::make(double samp_rate)
+    {
+        return gnuradio::get_initial_sptr(new iq_recorder_c_impl(samp_rate));
+    }
+
+    iq_recorder_c_impl::iq_recorder_c_impl(double samp_rate)
+      : gr::sync_block("strx_iq_recorder_c",
+                       gr::io_signature::make(1, 1, sizeof (gr_complex)),
+                       gr::io_signature::make(0, 0, 0)),
+        d_recording(false),
+        d_draining(false),
+        d_format(IQ_FORMAT_FC32),
+        d_new_format(IQ_FORMAT_FC32),
+        d_pretrig(0.0),
+        d_samp_rate(samp_rate),
+        d_freq(0.0),
+        d_t0_ns(0),
+        d_sample(0),
+        d_accepted(0),
+        d_nstage(0),
+        d_ring_bufs(0),
+        d_fill(0),
+        d_fill_items(0),
+        d_head(0),
+        d_tail(0),
+        d_closing(false),
+        d_fd(-1),
+        d_direct(false),
+        d_failed(false),
+        d_bytes(0),
+        d_dropped(0),
+        d_written(0)
+    {
+        d_stage = new gr_complex[iq_block_items(IQ_FORMAT_SC8)];
+        setup_buffers();
+    }
+
+    iq_recorder_c_impl::~iq_recorder_c_impl()
+    {
+        close();
+        for (size_t i = 0; i < d_buf.size(); i++)
+            free(d_buf[i]);
+        delete [] d_stage;
+    }
+
+    int iq_recorder_c_impl::work(int noutput_items,
+                                 gr_vector_const_void_star &input_items,
+                                 gr_vector_void_star &output_items)
+    {
+        const gr_complex *in = (const gr_complex *) input_items[0];
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        (void) output_items;
+
+        // while close() drains the queue the writer owns the buffers, and the
+        // ring is restarted afterwards anyway
+        if (d_recording || (d_ring_bufs > 0 && !d_draining))
+            append(in, noutput_items);
+
+        return noutput_items;
+    }
+
+    /*! \brief Size the buffers for the configured format and pre-trigger time.
+     *
+     * Also empties the buffers and restarts the sample count, which is what
+     * the pre-trigger ring needs after a recording. Must be called with
+     * d_mutex held and no recording in progress.
+     */
+    void iq_recorder_c_impl::setup_buffers()
+    {
+        struct timespec now;
+        double rate;
+        size_t num;
+
+        d_format = d_new_format;
+
+        // bytes per second in the buffers, including the block headers
+        if (d_format == IQ_FORMAT_FC32)
+            rate = d_samp_rate * sizeof(gr_complex);
+        else
+            rate = d_samp_rate * IQ_BLOCK_SIZE / iq_block_items(d_format);
+        d_ring_bufs = (uint64_t)ceil(d_pretrig * rate / REC_BUF_SIZE);
+
+        num = d_ring_bufs + REC_NUM_BUFS;
+        while (d_buf.size() > num)
+        {
+            free(d_buf.back());
+            d_buf.pop_back();
+        }
+        while (d_buf.size() < num)
+        {
+            void *p;
+
+            if (posix_memalign(&p, REC_ALIGN, REC_BUF_SIZE))
+                throw std::bad_alloc();
+            d_buf.push_back((char *)p);
+        }
+        d_len.assign(num, 0);
+        d_items.assign(num, 0);
+
+        d_head = 0;
+        d_tail = 0;
+        d_fill = 0;
+        d_fill_items = 0;
+        d_nstage = 0;
+        d_sample = 0;
+        clock_gettime(CLOCK_REALTIME, &now);
+        d_t0_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+
+    /*! \brief Check whether a new buffer can be started.
+     *
+     * While recording, the buffer is free unless all buffers are queued for
+     * the writer. Otherwise the buffers are the pre-trigger ring, and the
+     * oldest buffer is given up when the ring is full; there is no writer
+     * then, so the tail is ours. Must be called with d_mutex held.
+     */
+    bool iq_recorder_c_impl::buffer_free()
+    {
+        uint64_t queued = d_head - __atomic_load_n(&d_tail, __ATOMIC_ACQUIRE);
+
+        if (d_recording)
+            return queued < d_buf.size();
+
+        // keep d_ring_bufs full buffers besides the one being started
+        if (queued > d_ring_bufs)
+            d_tail++;
+
+        return true;
+    }
+
+    /*! \brief Copy samples into the recording buffers.
+     *
+     * Full buffers are queued for the writer. The samples that don't fit
+     * because all buffers are queued are dropped. Must be called with d_mutex
+     * held.
+     */
+    void iq_recorder_c_impl::append(const gr_complex *in, int nitems)
+    {
+        int n;
+
+        if (d_format != IQ_FORMAT_FC32)
+        {
+            // collect a block worth of samples, the scale depends on all of them
+            int block_items = iq_block_items(d_format);
+
+            while (nitems > 0)
+            {
+                n = std::min(nitems, block_items - d_nstage);
+                memcpy(d_stage + d_nstage, in, n * sizeof(gr_complex));
+                d_nstage += n;
+                d_sample += n;
+                in += n;
+                nitems -= n;
+
+                if (d_nstage == block_items)
+                {
+                    append_block(d_stage, d_nstage);
+                    d_nstage = 0;
+                }
+            }
+            return;
+        }
+
+        while (nitems > 0)
+        {
+            // a buffer being filled is ours, an empty one may still be queued
+            if (d_fill == 0 && !buffer_free())
+            {
+                __atomic_add_fetch(&d_dropped, nitems, __ATOMIC_RELAXED);
+                d_sample += nitems;
+                return;
+            }
+
+            n = std::min(nitems, (int)((REC_BUF_SIZE - d_fill) / sizeof(gr_complex)));
+            memcpy(d_buf[d_head % d_buf.size()] + d_fill, in, n * sizeof(gr_complex));
+            d_fill += n * sizeof(gr_complex);
+            d_fill_items += n;
+            d_accepted += n;
+            d_sample += n;
+            in += n;
+            nitems -= n;
+
+            if (d_fill == REC_BUF_SIZE)
+                push_buffer();
+        }
+    }
+
+    /*! \brief Convert samples to an SC16/SC8 block in the recording buffers.
+     *
+     * The block is dropped as a whole if all buffers are queued, so that the
+     * file stays a sequence of complete blocks; the sample numbers in the
+     * headers show the gap. Must be called with d_mutex held.
+     */
+    void iq_recorder_c_impl::append_block(const gr_complex *in, int nitems)
+    {
+        const float *s = (const float *)in;
+        float peak = 0.f;
+        float inv;
+        int i;
+
+        // blocks divide the buffers, so a block being filled always has room
+        if (d_fill == 0 && !buffer_free())
+        {
+            __atomic_add_fetch(&d_dropped, nitems, __ATOMIC_RELAXED);
+            return;
+        }
+
+        for (i = 0; i < 2 * nitems; i++)
+            peak = std::max(peak, fabsf(s[i]));
+
+        char *block = d_buf[d_head % d_buf.size()] + d_fill;
+        iq_block_header *hdr = (iq_block_header *)block;
+        int maxint = d_format == IQ_FORMAT_SC16 ? 32767 : 127;
+
+        memset(hdr, 0, sizeof(*hdr));
+        memcpy(hdr->magic, IQ_BLOCK_MAGIC, 4);
+        hdr->version = IQ_BLOCK_VERSION;
+        hdr->format = d_format;
+        hdr->hdr_len = sizeof(*hdr);
+        hdr->nitems = nitems;
+        hdr->scale = peak > 0.f ? peak / maxint : 1.f;
+        hdr->sample = d_sample - nitems;
+        hdr->time_ns = d_t0_ns + (int64_t)(hdr->sample * 1.e9 / d_samp_rate);
+        hdr->freq = d_freq;
+        hdr->rate = d_samp_rate;
+
+        inv = 1.f / hdr->scale;
+        if (d_format == IQ_FORMAT_SC16)
+        {
+            int16_t *out = (int16_t *)(hdr + 1);
+            for (i = 0; i < 2 * nitems; i++)
+                out[i] = (int16_t)lrintf(s[i] * inv);
+        }
+        else
+        {
+            int8_t *out = (int8_t *)(hdr + 1);
+            for (i = 0; i < 2 * nitems; i++)
+                out[i] = (int8_t)lrintf(s[i] * inv);
+        }
+
+        // the last block of a recording is partial
+        size_t used = sizeof(*hdr) + nitems * iq_format_bytes(d_format);
+        memset(block + used, 0, IQ_BLOCK_SIZE - used);
+
+        d_fill += IQ_BLOCK_SIZE;
+        d_fill_items += nitems;
+        d_accepted += nitems;
+        if (d_fill == REC_BUF_SIZE)
+            push_buffer();
+    }
+
+    /*! \brief Queue the buffer being filled. Must be called with d_mutex held. */
+    void iq_recorder_c_impl::push_buffer()
+    {
+        d_len[d_head % d_buf.size()] = d_fill;
+        d_items[d_head % d_buf.size()] = d_fill_items;
+        d_fill = 0;
+        d_fill_items = 0;
+        __atomic_store_n(&d_head, d_head + 1, __ATOMIC_RELEASE);
+    }
+
+    /*! \brief Write one buffer to the file.
+     *
+     * With O_DIRECT the write size must be aligned too, so the last, partial
+     * buffer is padded here and the file is truncated when it is closed.
+     */
+    bool iq_recorder_c_impl::write_buffer(char *buf, size_t len)
+    {
+        size_t size = len;
+        ssize_t ret;
+
+        if (d_direct && size % REC_ALIGN)
+        {
+            size = (size + REC_ALIGN - 1) & ~(size_t)(REC_ALIGN - 1);
+            memset(buf + len, 0, size - len);
+        }
+
+        for (size_t done = 0; done < size; done += ret)
+        {
+            ret = write(d_fd, buf + done, size - done);
+            if (ret < 0 && errno == EINTR)
+                ret = 0;
+            else if (ret <= 0)
+                return false;
+        }
+
+        if (!d_direct)
+        {
+            // without O_DIRECT, at least don't let written data pile up in the page cache
+            fdatasync(d_fd);
+            posix_fadvise(d_fd, d_bytes, len, POSIX_FADV_DONTNEED);
+        }
+        d_bytes += len;
+
+        return true;
+    }
+
+    /*! \brief Writer thread.
+     *
+     * Writes the queued buffers in order and exits when the recording is
+     * closed and the queue is empty.
+     */
+    void iq_recorder_c_impl::writer_func()
+    {
+        uint64_t head;
+        uint64_t items;
+        size_t len;
+        char *buf;
+
+        for (;;)
+        {
+            head = __atomic_load_n(&d_head, __ATOMIC_ACQUIRE);
+            if (d_tail == head)
+            {
+                if (__atomic_load_n(&d_closing, __ATOMIC_ACQUIRE))
+                    break;
+                boost::this_thread::sleep(boost::posix_time::milliseconds(REC_POLL_MS));
+                continue;
+            }
+
+            buf = d_buf[d_tail % d_buf.size()];
+            len = d_len[d_tail % d_buf.size()];
+            items = d_items[d_tail % d_buf.size()];
+            if (!d_failed && !write_buffer(buf, len))
+            {
+                std::cerr << "I/Q recorder: write failed: " << strerror(errno) << std::endl;
+                d_failed = true;
+            }
+            if (d_failed)
+                __atomic_add_fetch(&d_dropped, items, __ATOMIC_RELAXED);
+            else
+                __atomic_add_fetch(&d_written, items, __ATOMIC_RELAXED);
+
+            __atomic_store_n(&d_tail, d_tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    bool iq_recorder_c_impl::open(const std::string &filename)
+    {
+        close();
+
+        d_direct = true;
+        d_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (d_fd < 0 && errno == EINVAL)
+        {
+            // file system without O_DIRECT support, e.g. tmpfs on older kernels
+            d_direct = false;
+            d_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (d_fd < 0)
+        {
+            std::cerr << "I/Q recorder: can't open " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        d_failed = false;
+        d_bytes = 0;
+        __atomic_store_n(&d_written, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&d_dropped, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&d_closing, false, __ATOMIC_RELAXED);
+
+        {
+            boost::mutex::scoped_lock lock(d_mutex);
+
+            // start from scratch, or from the oldest sample in the pre-trigger ring
+            if (d_ring_bufs == 0)
+                setup_buffers();
+            d_accepted = d_fill_items;
+            for (uint64_t i = d_tail; i < d_head; i++)
+                d_accepted += d_items[i % d_buf.size()];
+            d_recording = true;
+        }
+
+        // the ring is written first, then the live samples
+        d_writer = boost::thread(&iq_recorder_c_impl::writer_func, this);
+
+        return true;
+    }
+
+    void iq_recorder_c_impl::set_format(int format)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        d_new_format = format;
+        if (!d_recording && !d_draining)
+            setup_buffers();
+    }
+
+    void iq_recorder_c_impl::set_pretrigger(double seconds)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        d_pretrig = std::max(seconds, 0.0);
+        if (!d_recording && !d_draining)
+            setup_buffers();
+    }
+
+    void iq_recorder_c_impl::set_center_freq(double freq)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        d_freq = freq;
+    }
+
+    void iq_recorder_c_impl::get_position(uint64_t *offset, int64_t *time_ns)
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        *offset = d_accepted + d_nstage;
+        *time_ns = d_t0_ns + (int64_t)(d_sample * 1.e9 / d_samp_rate);
+    }
+
+    void iq_recorder_c_impl::close()
+    {
+        {
+            boost::mutex::scoped_lock lock(d_mutex);
+
+            if (!d_recording)
+                return;
+
+            if (d_nstage > 0)
+                append_block(d_stage, d_nstage);
+            if (d_fill > 0)
+                push_buffer();
+            d_recording = false;
+            d_draining = true;
+        }
+
+        // let the writer drain the queue
+        __atomic_store_n(&d_closing, true, __ATOMIC_RELEASE);
+        d_writer.join();
+
+        if (d_direct && ftruncate(d_fd, d_bytes) < 0)
+            std::cerr << "I/Q recorder: can't truncate file: " << strerror(errno) << std::endl;
+        ::close(d_fd);
+        d_fd = -1;
+
+        if (d_dropped > 0)
+            std::cerr << "I/Q recorder: " << d_dropped << " samples dropped" << std::endl;
+
+        // restart the pre-trigger ring, with any format or pre-trigger time set meanwhile
+        boost::mutex::scoped_lock lock(d_mutex);
+        d_draining = false;
+        setup_buffers();
+    }
+
+    bool iq_recorder_c_impl::is_recording()
+    {
+        boost::mutex::scoped_lock lock(d_mutex);
+
+        return d_recording;
+    }
+
+    uint64_t iq_recorder_c_impl::dropped()
+    {
+        return __atomic_load_n(&d_dropped, __ATOMIC_RELAXED);
+    }
+
+    uint64_t iq_recorder_c_impl::written()
+    {
+        return __atomic_load_n(&d_written, __ATOMIC_RELAXED);
+    }
+
+} // namespace strx
@@ -0,0 +1,113 @@
+/* -*- c++ -*- */
+/*
+ * Copyright 2013 Alexandru Csete, OZ9AEC
+ *
+ * Strx is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * Strx is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GNU Radio; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street,
+ * Boston, MA 02110-1301, USA.
+ */
+#ifndef INCLUDED_STRX_IQ_RECORDER_C_IMPL_H
+#define INCLUDED_STRX_IQ_RECORDER_C_IMPL_H
+
+#include <stdint.h>
+#include <vector>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <gnuradio/gr_complex.h>
+
+#include "strx_iq_recorder_c.h"
+
+/*! Size of each recording buffer in bytes, a multiple of REC_ALIGN and IQ_BLOCK_SIZE. */
+#define REC_BUF_SIZE (4 << 20)
+
+/*! Number of recording buffers in addition to the pre-trigger ring, about 2 seconds at 4 Msps. */
+#define REC_NUM_BUFS 16
+
+/*! Alignment of buffers, file offsets and write sizes required by O_DIRECT. */
+#define REC_ALIGN 4096
+
+/*! Writer thread poll interval in milliseconds when the queue is empty. */
+#define REC_POLL_MS 10
+
+namespace strx {
+
+    class iq_recorder_c_impl : public iq_recorder_c
+    {
+    public:
+        iq_recorder_c_impl(double samp_rate);
+        ~iq_recorder_c_impl();
+
+        int work(int noutput_items,
+                 gr_vector_const_void_star &input_items,
+                 gr_vector_void_star &output_items);
+
+        // Public API functions documented in strx_iq_recorder_c.h
+        bool open(const std::string &filename);
+        void set_format(int format);
+        void set_pretrigger(double seconds);
+        void set_center_freq(double freq);
+        void get_position(uint64_t *offset, int64_t *time_ns);
+        void close();
+        bool is_recording();
+        uint64_t dropped();
+        uint64_t written();
+
+    private:
+        void append(const gr_complex *in, int nitems);
+        void append_block(const gr_complex *in, int nitems);
+        bool buffer_free();
+        void push_buffer();
+        void setup_buffers();
+        void writer_func();
+        bool write_buffer(char *buf, size_t len);
+
+        boost::mutex  d_mutex;      /*! Protects the fill buffer and the state against open() and close(); never held during disk I/O. */
+        bool          d_recording;
+        bool          d_draining;   /*! close() waits for the writer; the buffers are not ours. */
+        int           d_format;     /*! Format of the buffered samples. */
+        int           d_new_format; /*! Format set by set_format(), applied when not recording. */
+        double        d_pretrig;    /*! Pre-trigger time set by set_pretrigger(), applied when not recording. */
+        double        d_samp_rate;
+        double        d_freq;       /*! Center frequency for the block headers. */
+        int64_t       d_t0_ns;      /*! Wall clock time of sample 0. */
+        uint64_t      d_sample;     /*! Number of samples since the recording or the ring started, dropped samples included. */
+        uint64_t      d_accepted;   /*! Number of samples in the file, queued or written, since the recording started. */
+
+        gr_complex   *d_stage;      /*! Samples collected for the next SC16/SC8 block. */
+        int           d_nstage;     /*! Number of samples in d_stage. */
+
+        std::vector<char *>   d_buf;    /*! The buffers, aligned to REC_ALIGN. */
+        std::vector<size_t>   d_len;    /*! Number of bytes in each queued buffer. */
+        std::vector<uint64_t> d_items;  /*! Number of samples in each queued buffer. */
+        uint64_t      d_ring_bufs;  /*! Number of full buffers kept as pre-trigger ring while not recording, 0 for none. */
+        size_t        d_fill;       /*! Number of bytes in the buffer being filled. */
+        uint64_t      d_fill_items; /*! Number of samples in the buffer being filled. */
+
+        uint64_t      d_head;       /*! Number of buffers queued; written by work(), read by the writer. */
+        uint64_t      d_tail;       /*! Number of buffers written; written by the writer, read by work(). */
+        bool          d_closing;    /*! Tells the writer to exit once the queue is empty. */
+
+        int           d_fd;         /*! The file being recorded. */
+        bool          d_direct;     /*! The file was opened with O_DIRECT. */
+        bool          d_failed;     /*! A write failed; the rest of the recording is dropped. */
+        uint64_t      d_bytes;      /*! Number of bytes written to the file. */
+        uint64_t      d_dropped;    /*! Number of samples dropped. */
+        uint64_t      d_written;    /*! Number of samples written. */
+
+        boost::thread d_writer;     /*! The writer thread, running while recording. */
+    };
+
+} // namespace strx
+
+#endif /* INCLUDED_STRX_IQ_RECORDER_C_IMPL_H */
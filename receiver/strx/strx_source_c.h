@@ -31,7 +31,8 @@ namespace strx {
     /*! \brief Strx source block.
      *
      * This block provides an input source for the Sapphire telemetry reciever.
-     * The input source can be either a USRP saource or a file source with a throttle.
+     * The input source can be either a USRP saource or an I/Q file source which
+     * replays the file in real time or at a chosen speed.
      */
     class STRX_API source_c : virtual public gr::hier_block2
     {
@@ -84,6 +85,41 @@ namespace strx {
          *  \param antenna String describing the antenna, e.g. "RX2".
          */
         virtual void set_antenna(std::string antenna) = 0;
+
+        /*! \brief Seek in the I/Q file.
+         *  \param seconds The new position in seconds from the beginning of the file.
+         *
+         * If the recording has an index, the position is the wall clock time
+         * since the first sample, gaps in the recording included. This
+         * function has no effect when using a USRP.
+         */
+        virtual void set_position(double seconds) = 0;
+
+        /*! \brief Get the current position in the I/Q file.
+         *  \returns The position in seconds from the beginning of the file or 0 if using a USRP.
+         */
+        virtual double get_position() = 0;
+
+        /*! \brief Set I/Q file replay speed.
+         *  \param speed The replay speed relative to real time, 0 for as fast as possible.
+         *
+         * This function has no effect when using a USRP.
+         */
+        virtual void set_speed(double speed) = 0;
+
+        /*! \brief Get the current I/Q file replay speed.
+         *  \returns The replay speed or 1 if using a USRP.
+         */
+        virtual double get_speed() = 0;
+
+        /*! \brief Set the part of the I/Q file to replay.
+         *  \param start The beginning of the part in seconds.
+         *  \param stop The end of the part in seconds, 0 for the end of the file.
+         *  \param loop Whether to loop over the part or finish at its end.
+         *
+         * This function has no effect when using a USRP.
+         */
+        virtual void set_region(double start, double stop, bool loop) = 0;
     };
 
 } // namespace strx
@@ -20,6 +20,7 @@
 
 #include "strx_source_c_impl.h"
 
+#include <algorithm>
 #include <gnuradio/config.h>
 #include <gnuradio/attributes.h>
 #include <gnuradio/io_signature.h>
@@ -47,11 +48,9 @@ namespace strx {
         {
             input_type = INPUT_TYPE_FILE;
             std::string filename = input.substr(5);
-            file_src = gr::blocks::file_source::make(sizeof(gr_complex), filename.c_str(), true);
-            throttle = gr::blocks::throttle::make(sizeof(gr_complex), d_quad_rate);
-            
-            connect(file_src, 0, throttle, 0);
-            connect(throttle, 0, self(), 0);
+            file_src = strx::file_source_c::make(filename, d_quad_rate, true);
+
+            connect(file_src, 0, self(), 0);
         }
         else
         {
@@ -141,6 +140,41 @@ namespace strx {
             usrp_src->set_antenna(antenna);
     }
 
+    void source_c_impl::set_position(double seconds)
+    {
+        if (input_type == INPUT_TYPE_FILE)
+            file_src->seek(file_src->time_to_sample(seconds));
+    }
+
+    double source_c_impl::get_position(void)
+    {
+        if (input_type == INPUT_TYPE_FILE)
+            return file_src->sample_to_time(file_src->tell());
+        else
+            return 0.0;
+    }
+
+    void source_c_impl::set_speed(double speed)
+    {
+        if (input_type == INPUT_TYPE_FILE)
+            file_src->set_speed(speed);
+    }
+
+    double source_c_impl::get_speed(void)
+    {
+        if (input_type == INPUT_TYPE_FILE)
+            return file_src->speed();
+        else
+            return 1.0;
+    }
+
+    void source_c_impl::set_region(double start, double stop, bool loop)
+    {
+        if (input_type == INPUT_TYPE_FILE)
+            file_src->set_region(file_src->time_to_sample(start),
+                                 stop > 0.0 ? file_src->time_to_sample(stop) : 0, loop);
+    }
+
     void source_c_impl::setup_rpc(void)
     {
     #ifdef GR_CTRLPORT
@@ -188,6 +222,48 @@ namespace strx {
             )
         );
 
+        // Replay position and speed, only meaningful for I/Q files
+        if (input_type == INPUT_TYPE_FILE)
+        {
+            stop = file_src->sample_to_time(file_src->nitems_total());
+            add_rpc_variable(
+                rpcbasic_sptr(new rpcbasic_register_get<source_c, double>(
+                    alias(), "position",
+                    &source_c::get_position,
+                    pmt::mp(0.0), pmt::mp(stop), pmt::mp(0.0),
+                    "s", "I/Q file position",
+                    RPC_PRIVLVL_MIN, DISPNULL)
+                )
+            );
+            add_rpc_variable(
+                rpcbasic_sptr(new rpcbasic_register_set<source_c, double>(
+                    alias(), "position",
+                    &source_c::set_position,
+                    pmt::mp(0.0), pmt::mp(stop), pmt::mp(0.0),
+                    "s", "I/Q file position",
+                    RPC_PRIVLVL_MIN, DISPNULL)
+                )
+            );
+            add_rpc_variable(
+                rpcbasic_sptr(new rpcbasic_register_get<source_c, double>(
+                    alias(), "speed",
+                    &source_c::get_speed,
+                    pmt::mp(0.0), pmt::mp(100.0), pmt::mp(1.0),
+                    "", "I/Q file replay speed (0 = unthrottled)",
+                    RPC_PRIVLVL_MIN, DISPNULL)
+                )
+            );
+            add_rpc_variable(
+                rpcbasic_sptr(new rpcbasic_register_set<source_c, double>(
+                    alias(), "speed",
+                    &source_c::set_speed,
+                    pmt::mp(0.0), pmt::mp(100.0), pmt::mp(1.0),
+                    "", "I/Q file replay speed (0 = unthrottled)",
+                    RPC_PRIVLVL_MIN, DISPNULL)
+                )
+            );
+        }
+
     #endif
     }
 
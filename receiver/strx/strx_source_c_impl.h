@@ -21,10 +21,9 @@
 #define INCLUDED_STRX_SOURCE_C_IMPL_H
 
 #include <gnuradio/config.h>
-#include <gnuradio/blocks/file_source.h>
-#include <gnuradio/blocks/throttle.h>
 #include <gnuradio/uhd/usrp_source.h>
 
+#include "strx_file_source_c.h"
 #include "strx_source_c.h"
 
 namespace strx {
@@ -45,6 +44,12 @@ namespace strx {
 
         void set_antenna(std::string antenna);
 
+        void set_position(double seconds);
+        double get_position(void);
+        void set_speed(double speed);
+        double get_speed(void);
+        void set_region(double start, double stop, bool loop);
+
         void setup_rpc(void);
 
     private:
@@ -59,8 +64,7 @@ namespace strx {
         input_type_e input_type;
 
         gr::uhd::usrp_source::sptr                  usrp_src;  /*!< USRP source. */
-        gr::blocks::file_source::sptr               file_src;  /*!< I/Q file source. */
-        gr::blocks::throttle::sptr                  throttle;  /*!< Rate limiter for file sources. */
+        strx::file_source_c::sptr                   file_src;  /*!< I/Q file source. */
 
         double d_quad_rate; /*!< Quadrature rate. */
         double d_freq;      /*!< Current RF frequency. */